@@ -0,0 +1,57 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+/*
+ * Software CRC for the host benchmarks, linked in place of crc.c.
+ * Table-driven, one byte at a time, same result as the STM32 CRC unit.
+ */
+
+#include <string.h>
+#include "crc.h"
+
+#define BENCH_CRC_POLY      0x04C11DB7UL
+#define BENCH_CRC_INIT      0xFFFFFFFFUL
+
+static uint32_t bench_crc_table[256];
+
+static void bench_crc_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i << 24;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80000000UL) ? (crc << 1) ^ BENCH_CRC_POLY : (crc << 1);
+        }
+        bench_crc_table[i] = crc;
+    }
+}
+
+static uint32_t bench_crc_word(uint32_t crc, uint32_t word) {
+    crc ^= word;
+    for (int i = 0; i < 4; i++) {
+        crc = (crc << 8) ^ bench_crc_table[crc >> 24];
+    }
+    return crc;
+}
+
+uint32_t crc_calc(const void *data, size_t size) {
+    const uint8_t *byte_p = data;
+    uint32_t crc = BENCH_CRC_INIT;
+    uint32_t word;
+    if (bench_crc_table[1] == 0) {
+        bench_crc_init_table();
+    }
+    while (size > sizeof(word)) {
+        memcpy(&word, byte_p, sizeof(word));
+        crc = bench_crc_word(crc, word);
+        byte_p += sizeof(word);
+        size -= sizeof(word);
+    }
+    if (size) {
+        word = 0;
+        memcpy(&word, byte_p, size);
+        crc = bench_crc_word(crc, word);
+    }
+    return crc;
+}
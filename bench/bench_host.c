@@ -0,0 +1,299 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+/*
+ * Host Benchmarks
+ *
+ * Builds the pure-logic hot paths with the host compiler and times them with
+ * fixed iteration counts, so that kernel rewrites can be compared before
+ * flashing a board. Packet memory is a plain array with the same 32-bit stride,
+ * bench_crc.c replaces the CRC unit with a table-driven software CRC-32.
+ * Absolute numbers only make sense relative to each other on the same host.
+ *
+ * Output, one line per benchmark, whitespace-separated:
+ *   <name> <iterations> <bytes per iteration> <ns per iteration>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usb_cdc.h"
+#include "usb_io.h"
+#include "circ_buf.h"
+#include "usb_pbuffer.h"
+#include "crc.h"
+#include "device_config.h"
+#include "cdc_shell.h"
+
+#define BENCH_REPEATS       11
+#define BENCH_RING_SIZE     0x400
+#define BENCH_PACKET_SIZE   64
+#define BENCH_PMA_WORDS     (BENCH_PACKET_SIZE / sizeof(pb_word_t))
+
+/* Peripheral Stand-ins */
+
+GPIO_TypeDef    bench_gpio[3];
+RCC_TypeDef     bench_rcc;
+FLASH_TypeDef   bench_flash;
+DWT_Type        bench_dwt;
+uint8_t         bench_flash_memory[0x10000];
+
+/* Firmware Stand-ins */
+
+static size_t bench_shell_output;
+
+void cdc_shell_write(const void *buf, size_t count) {
+    (void)buf;
+    bench_shell_output += count;
+}
+
+void usb_cdc_reconfigure() {
+}
+
+void usb_cdc_reconfigure_port_pin(int port, cdc_pin_t pin) {
+    (void)port;
+    (void)pin;
+}
+
+int usb_cdc_buf_sizes_valid(const size_t *rx_buf_sizes, const size_t *tx_buf_sizes) {
+    (void)rx_buf_sizes;
+    (void)tx_buf_sizes;
+    return 1;
+}
+
+void usb_cdc_get_port_stats(int port, usb_cdc_port_stats_t *stats) {
+    (void)port;
+    memset(stats, 0, sizeof(*stats));
+}
+
+const usb_io_poll_stats_t *usb_io_get_poll_stats() {
+    static usb_io_poll_stats_t poll_stats;
+    return &poll_stats;
+}
+
+char *itoa(int value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : "%d", value);
+    return str;
+}
+
+char *utoa(unsigned value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : "%u", value);
+    return str;
+}
+
+/* Timing */
+
+static volatile uint32_t bench_sink;
+
+#define bench_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+static uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef void (*bench_func_t)(uint32_t iterations);
+
+static void bench_run(const char *name, bench_func_t func, uint32_t iterations, size_t bytes) {
+    uint64_t best_ns = UINT64_MAX;
+    func(iterations / 16);
+    for (int i = 0; i < BENCH_REPEATS; i++) {
+        uint64_t start_ns = bench_now_ns();
+        func(iterations);
+        uint64_t elapsed_ns = bench_now_ns() - start_ns;
+        if (elapsed_ns < best_ns) {
+            best_ns = elapsed_ns;
+        }
+    }
+    printf("%-28s %10u %5zu %10.2f\n", name, iterations, bytes, (double)best_ns / iterations);
+}
+
+/* Circular Buffer Macros */
+
+static void bench_circ_buf_macros(uint32_t iterations) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        int head = (i * 37) & (BENCH_RING_SIZE - 1);
+        int tail = (i * 11) & (BENCH_RING_SIZE - 1);
+        sum += circ_buf_count(head, tail, BENCH_RING_SIZE);
+        sum += circ_buf_space(head, tail, BENCH_RING_SIZE);
+        sum += circ_buf_count_to_end(head, tail, BENCH_RING_SIZE);
+        sum += circ_buf_space_to_end(head, tail, BENCH_RING_SIZE);
+        bench_barrier();
+    }
+    bench_sink = sum;
+}
+
+/* Packet Memory Copy */
+
+static uint8_t bench_ring_storage[sizeof(circ_buf_t) + BENCH_RING_SIZE] __attribute__ ((aligned(4)));
+#define bench_ring ((circ_buf_t *)bench_ring_storage)
+static usb_pbuffer_data_t bench_pma[BENCH_PMA_WORDS];
+
+/* Ring position of the packet: even, odd, or split 37 bytes before the ring end */
+static int bench_ring_pos;
+
+#define BENCH_WRAP_SPAN_SIZE    37
+
+static const struct {
+    const char *name;
+    int pos;
+} bench_ring_positions[] = {
+    { "even", 0 },
+    { "odd",  1 },
+    { "wrap", BENCH_RING_SIZE - BENCH_WRAP_SPAN_SIZE },
+};
+
+/* As in usb_circ_buf_send() */
+static void bench_pma_send(uint32_t iterations) {
+    circ_buf_t *buf = bench_ring;
+    for (uint32_t i = 0; i < iterations; i++) {
+        buf->tail = bench_ring_pos;
+        buf->head = (bench_ring_pos + BENCH_PACKET_SIZE) & (BENCH_RING_SIZE - 1);
+        size_t count = circ_buf_count(buf->head, buf->tail, BENCH_RING_SIZE);
+        size_t span_size = circ_buf_count_to_end(buf->head, buf->tail, BENCH_RING_SIZE);
+        if (span_size > count) {
+            span_size = count;
+        }
+        usb_pbuffer_copy_from_spans(bench_pma, &buf->data[buf->tail], span_size,
+                                    buf->data, count - span_size);
+        buf->tail = (buf->tail + count) & (BENCH_RING_SIZE - 1);
+        bench_barrier();
+    }
+}
+
+/* As in usb_circ_buf_read() */
+static void bench_pma_read(uint32_t iterations) {
+    circ_buf_t *buf = bench_ring;
+    for (uint32_t i = 0; i < iterations; i++) {
+        size_t count = BENCH_PACKET_SIZE;
+        buf->head = bench_ring_pos;
+        size_t span_size = BENCH_RING_SIZE - buf->head;
+        if (span_size > count) {
+            span_size = count;
+        }
+        usb_pbuffer_copy_to_spans(bench_pma, &buf->data[buf->head], span_size,
+                                  buf->data, count - span_size);
+        buf->head = (buf->head + count) & (BENCH_RING_SIZE - 1);
+        bench_barrier();
+    }
+}
+
+/* The byte loops usb_circ_buf_send()/usb_circ_buf_read() used before the span kernels */
+
+static void bench_pma_send_bytes(uint32_t iterations) {
+    circ_buf_t *buf = bench_ring;
+    for (uint32_t i = 0; i < iterations; i++) {
+        usb_pbuffer_data_t *ep_buf = bench_pma;
+        buf->tail = bench_ring_pos;
+        buf->head = (bench_ring_pos + BENCH_PACKET_SIZE) & (BENCH_RING_SIZE - 1);
+        size_t count = circ_buf_count(buf->head, buf->tail, BENCH_RING_SIZE);
+        size_t words_left = count >> 1;
+        while (words_left--) {
+            pb_word_t pb_word = buf->data[buf->tail];
+            buf->tail = (buf->tail + 1) & (BENCH_RING_SIZE - 1);
+            pb_word |= ((uint16_t)buf->data[buf->tail]) << 8;
+            buf->tail = (buf->tail + 1) & (BENCH_RING_SIZE - 1);
+            (ep_buf++)->data = pb_word;
+        }
+        if (count & 0x1) {
+            (ep_buf)->data = buf->data[buf->tail];
+            buf->tail = (buf->tail + 1) & (BENCH_RING_SIZE - 1);
+        }
+        bench_barrier();
+    }
+}
+
+static void bench_pma_read_bytes(uint32_t iterations) {
+    circ_buf_t *buf = bench_ring;
+    for (uint32_t i = 0; i < iterations; i++) {
+        usb_pbuffer_data_t *ep_buf = bench_pma;
+        size_t count = BENCH_PACKET_SIZE;
+        size_t words_left = count >> 1;
+        buf->head = bench_ring_pos;
+        while (words_left--) {
+            buf->data[buf->head] = (uint8_t)(ep_buf->data);
+            buf->head = (buf->head + 1) & (BENCH_RING_SIZE - 1);
+            buf->data[buf->head] = (uint8_t)(((ep_buf++)->data) >> 8);
+            buf->head = (buf->head + 1) & (BENCH_RING_SIZE - 1);
+        }
+        if (count & 0x1) {
+            buf->data[buf->head] = (uint8_t)(ep_buf->data);
+            buf->head = (buf->head + 1) & (BENCH_RING_SIZE - 1);
+        }
+        bench_barrier();
+    }
+}
+
+static void bench_run_pma(const char *name, bench_func_t func, uint32_t iterations) {
+    for (size_t i = 0; i < sizeof(bench_ring_positions) / sizeof(*bench_ring_positions); i++) {
+        char pos_name[64];
+        snprintf(pos_name, sizeof(pos_name), "%s_%s", name, bench_ring_positions[i].name);
+        bench_ring_pos = bench_ring_positions[i].pos;
+        bench_run(pos_name, func, iterations, BENCH_PACKET_SIZE);
+    }
+}
+
+/* 7-bit Data Masking, as in usb_cdc_port_send_rx_usb() */
+
+static void bench_rx_mask_7bit(uint32_t iterations) {
+    uint8_t *span = &bench_ring->data[BENCH_RING_SIZE - BENCH_WRAP_SPAN_SIZE];
+    size_t span_size = BENCH_WRAP_SPAN_SIZE;
+    uint8_t *wrap_span = &bench_ring->data[0];
+    size_t rx_bytes_available = BENCH_PACKET_SIZE;
+    for (uint32_t n = 0; n < iterations; n++) {
+        for (size_t i = 0; i < span_size; i++) {
+            span[i] &= 0x7f;
+        }
+        for (size_t i = 0; i < rx_bytes_available - span_size; i++) {
+            wrap_span[i] &= 0x7f;
+        }
+        bench_barrier();
+    }
+}
+
+/* Configuration CRC */
+
+static void bench_config_crc(uint32_t iterations) {
+    uint32_t crc = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        crc ^= crc_calc(device_config_get(), offsetof(device_config_t, crc));
+        bench_barrier();
+    }
+    bench_sink = crc;
+}
+
+/* Shell Command Line, echoed, tokenized and dispatched */
+
+static const char bench_cmd_line[] = "  uart 1 set   baud 115200\r\n";
+
+static void bench_shell_process_input(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        cdc_shell_process_input(bench_cmd_line, sizeof(bench_cmd_line) - 1);
+        bench_barrier();
+    }
+}
+
+int main() {
+    memset(bench_flash_memory, 0xff, sizeof(bench_flash_memory));
+    device_config_init();
+    cdc_shell_init();
+    for (size_t i = 0; i < BENCH_RING_SIZE; i++) {
+        bench_ring->data[i] = (uint8_t)(i * 7);
+    }
+    printf("# name iterations bytes ns_per_iteration\n");
+    bench_run("circ_buf_macros",            bench_circ_buf_macros,          10000000, 0);
+    bench_run_pma("pma_send",               bench_pma_send,                 2000000);
+    bench_run_pma("pma_send_bytes",         bench_pma_send_bytes,           2000000);
+    bench_run_pma("pma_read",               bench_pma_read,                 2000000);
+    bench_run_pma("pma_read_bytes",         bench_pma_read_bytes,           2000000);
+    bench_run("rx_mask_7bit",               bench_rx_mask_7bit,             2000000, BENCH_PACKET_SIZE);
+    bench_run("config_crc",                 bench_config_crc,               200000, offsetof(device_config_t, crc));
+    bench_run("shell_process_input",        bench_shell_process_input,      1000000, sizeof(bench_cmd_line) - 1);
+    return 0;
+}
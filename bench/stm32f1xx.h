@@ -0,0 +1,64 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+/*
+ * Host stand-in for the CMSIS device header, just enough to build
+ * device_config.c and cdc_shell.c for the host benchmarks. Peripherals
+ * are plain memory, none of the code paths that touch them are run.
+ * The flash is a host array, erased, so the stored config is not found.
+ * crc.c is replaced by bench_crc.c, the CRC unit is not needed.
+ */
+
+#ifndef BENCH_STM32F1XX_H
+#define BENCH_STM32F1XX_H
+
+#include <stdint.h>
+
+#define __IO    volatile
+
+typedef struct {
+    __IO uint32_t CRL, CRH, IDR, ODR, BSRR, BRR, LCKR;
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR, CFGR, CIR, APB2RSTR, APB1RSTR, AHBENR, APB2ENR, APB1ENR, BDCR, CSR;
+} RCC_TypeDef;
+
+typedef struct {
+    __IO uint32_t ACR, KEYR, OPTKEYR, SR, CR, AR, RESERVED, OBR, WRPR;
+} FLASH_TypeDef;
+
+typedef struct {
+    __IO uint32_t CTRL, CYCCNT;
+} DWT_Type;
+
+extern GPIO_TypeDef     bench_gpio[3];
+extern RCC_TypeDef      bench_rcc;
+extern FLASH_TypeDef    bench_flash;
+extern DWT_Type         bench_dwt;
+extern uint8_t          bench_flash_memory[0x10000];
+
+#define GPIOA           (&bench_gpio[0])
+#define GPIOB           (&bench_gpio[1])
+#define GPIOC           (&bench_gpio[2])
+#define RCC             (&bench_rcc)
+#define FLASH           (&bench_flash)
+#define DWT             (&bench_dwt)
+
+#define FLASH_BASE      ((uintptr_t)bench_flash_memory)
+
+#define FLASH_CR_LOCK       (1UL << 7)
+#define FLASH_CR_PG         (1UL << 0)
+#define FLASH_CR_PER        (1UL << 1)
+#define FLASH_CR_STRT       (1UL << 6)
+#define FLASH_SR_BSY        (1UL << 0)
+#define FLASH_SR_EOP        (1UL << 5)
+
+/* newlib extensions used by the shell */
+char *itoa(int value, char *str, int base);
+char *utoa(unsigned value, char *str, int base);
+
+#endif /* BENCH_STM32F1XX_H */
@@ -0,0 +1,188 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+/*
+ * Traffic Trace Decoder
+ *
+ * Reads the output of the "trace dump" shell command, rebuilds the trace
+ * buffer from the hex lines and prints one line per record, see trace.h
+ * for the record format. Lines without an offset, such as the shell prompt
+ * or the echoed command, are skipped.
+ *
+ * With -x type channel the payloads of the matching records are written to
+ * stdout back to back instead, e.g. "-x 4 0" extracts the UART 1 data as
+ * received, to be replayed into another port or compared with a capture.
+ *
+ * Usage: trace-decode [-c cpu_clock_hz] [-x type channel] [dump_file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define TRACE_DECODE_CPU_CLOCK      72000000UL
+#define TRACE_DECODE_LINE_SIZE      0x200
+
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static size_t trace_size;
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Parses "oooo: hhhh..." found anywhere in the line, returns -1 for other lines */
+static int trace_decode_dump_line(const char *line) {
+    const char *delim = strstr(line, ": ");
+    const char *p;
+    unsigned long offset = 0;
+    if (delim == 0 || (delim - line) < 4) {
+        return -1;
+    }
+    for (p = delim - 4; p < delim; p++) {
+        if (hex_digit(*p) < 0) {
+            return -1;
+        }
+        offset = (offset << 4) | hex_digit(*p);
+    }
+    for (p = delim + 2; (hex_digit(p[0]) >= 0) && (hex_digit(p[1]) >= 0); p += 2) {
+        if (offset >= sizeof(trace_buf)) {
+            return -1;
+        }
+        trace_buf[offset++] = (hex_digit(p[0]) << 4) | hex_digit(p[1]);
+    }
+    if (offset > trace_size) {
+        trace_size = offset;
+    }
+    return 0;
+}
+
+static uint32_t get_le(const uint8_t *data, size_t size) {
+    uint32_t value = 0;
+    while (size--) {
+        value = (value << 8) | data[size];
+    }
+    return value;
+}
+
+static const char *trace_decode_type_name(uint8_t type) {
+    switch (type) {
+    case trace_record_setup:
+        return "setup";
+    case trace_record_out:
+        return "out";
+    case trace_record_in:
+        return "in";
+    case trace_record_uart_rx:
+        return "uart_rx";
+    case trace_record_control_lines:
+        return "control_lines";
+    case trace_record_serial_state:
+        return "serial_state";
+    case trace_record_line_coding:
+        return "line_coding";
+    }
+    return "unknown";
+}
+
+static void trace_decode_payload(uint8_t type, const uint8_t *payload, size_t size) {
+    static const char *parity_names[] = { "none", "odd", "even", "mark", "space" };
+    static const char *stop_bits_names[] = { "1", "1.5", "2" };
+    if ((type == trace_record_setup) && (size == 8)) {
+        printf(" bmRequestType=0x%02x bRequest=0x%02x wValue=0x%04x wIndex=0x%04x wLength=%u",
+               payload[0], payload[1], get_le(&payload[2], 2), get_le(&payload[4], 2), get_le(&payload[6], 2));
+    } else if ((type == trace_record_control_lines) && (size == 2)) {
+        uint32_t state = get_le(payload, 2);
+        printf(" dtr=%u rts=%u", state & 0x01, (state >> 1) & 0x01);
+    } else if ((type == trace_record_serial_state) && (size == 2)) {
+        uint32_t state = get_le(payload, 2);
+        printf(" dcd=%u dsr=%u break=%u ri=%u framing=%u parity=%u overrun=%u",
+               state & 0x01, (state >> 1) & 0x01, (state >> 2) & 0x01, (state >> 3) & 0x01,
+               (state >> 4) & 0x01, (state >> 5) & 0x01, (state >> 6) & 0x01);
+    } else if ((type == trace_record_line_coding) && (size == 7)) {
+        printf(" baudrate=%u data=%u parity=%s stop=%s", get_le(payload, 4), payload[6],
+               (payload[5] < 5) ? parity_names[payload[5]] : "?",
+               (payload[4] < 3) ? stop_bits_names[payload[4]] : "?");
+    } else {
+        printf(" ");
+        for (size_t i = 0; i < size; i++) {
+            printf("%02x", payload[i]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long cpu_clock = TRACE_DECODE_CPU_CLOCK;
+    int extract = 0;
+    unsigned long extract_type = 0;
+    unsigned long extract_channel = 0;
+    FILE *dump = stdin;
+    char line[TRACE_DECODE_LINE_SIZE];
+    int arg = 1;
+    size_t offset = 0;
+    uint32_t records = 0;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+            cpu_clock = strtoul(argv[arg + 1], 0, 0);
+            arg += 2;
+        } else if (strcmp(argv[arg], "-x") == 0 && arg + 2 < argc) {
+            extract = 1;
+            extract_type = strtoul(argv[arg + 1], 0, 0);
+            extract_channel = strtoul(argv[arg + 2], 0, 0);
+            arg += 3;
+        } else {
+            fprintf(stderr, "Usage: %s [-c cpu_clock_hz] [-x type channel] [dump_file]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (arg < argc) {
+        dump = fopen(argv[arg], "r");
+        if (dump == 0) {
+            perror(argv[arg]);
+            return 1;
+        }
+    }
+    while (fgets(line, sizeof(line), dump)) {
+        trace_decode_dump_line(line);
+    }
+    if (cpu_clock == 0) {
+        cpu_clock = TRACE_DECODE_CPU_CLOCK;
+    }
+    while (offset + sizeof(trace_record_t) <= trace_size) {
+        const trace_record_t *record = (const trace_record_t*)&trace_buf[offset];
+        uint32_t timestamp = get_le((const uint8_t*)&record->timestamp, sizeof(record->timestamp));
+        size_t size = get_le((const uint8_t*)&record->size, sizeof(record->size));
+        if (offset + sizeof(trace_record_t) + size > trace_size) {
+            fprintf(stderr, "Truncated record at 0x%04zx\n", offset);
+            return 1;
+        }
+        if (extract) {
+            if ((record->type == extract_type) && (record->channel == extract_channel)) {
+                fwrite(record->payload, 1, size, stdout);
+            }
+        } else {
+            printf("%12.3f us %-13s %u %4zu", (double)timestamp * 1e6 / cpu_clock,
+                   trace_decode_type_name(record->type), record->channel, size);
+            trace_decode_payload(record->type, record->payload, size);
+            printf("\n");
+        }
+        records++;
+        offset += (sizeof(trace_record_t) + size + 3) & ~3;
+    }
+    if (!extract) {
+        printf("# %u records, %zu bytes\n", records, trace_size);
+    }
+    return 0;
+}
@@ -10,8 +10,13 @@
 #include "gpio.h"
 #include "usb_cdc.h"
 
+#define CDC_PORT_LATENCY_TIMER_MAX  255 /* ms */
+
 typedef struct {
     gpio_pin_t pins[cdc_pin_last];
+    uint8_t    latency_timer; /* ms, 0 sends received data right away */
+    uint16_t   rx_buf_size;
+    uint16_t   tx_buf_size;
 } __attribute__ ((packed)) cdc_port_t;
 
 typedef struct {
@@ -8,10 +8,14 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include "usb_cdc.h"
+#include "usb_io.h"
 #include "gpio.h"
 #include "cdc_config.h"
 #include "device_config.h"
 #include "version.h"
+#include "trace.h"
+#include "perf.h"
+#include "event_trace.h"
 #include "cdc_shell.h"
 
 
@@ -43,6 +47,43 @@ static void cdc_shell_write_string(const char *buf) {
     cdc_shell_write(buf, strlen(buf));
 }
 
+/*
+ * Output in Parts
+ *
+ * Shell output is queued to the config port RX buffer, which holds
+ * USB_CDC_CONFIG_PORT_BUF_SIZE_MIN - 1 bytes at least, so commands
+ * printing more than that print one part at a time.
+ */
+
+typedef void (*cdc_shell_part_func_t)(int part);
+
+static cdc_shell_part_func_t cdc_shell_part_func;
+static int cdc_shell_next_part;
+static int cdc_shell_last_part;
+
+static void cdc_shell_write_parts(cdc_shell_part_func_t part_func, int first_part, int last_part) {
+    part_func(first_part);
+    if (first_part < last_part) {
+        cdc_shell_part_func = part_func;
+        cdc_shell_next_part = first_part + 1;
+        cdc_shell_last_part = last_part;
+    }
+}
+
+int cdc_shell_busy() {
+    return (cdc_shell_part_func != 0);
+}
+
+void cdc_shell_poll() {
+    if (cdc_shell_part_func) {
+        cdc_shell_part_func(cdc_shell_next_part);
+        if (cdc_shell_next_part++ == cdc_shell_last_part) {
+            cdc_shell_part_func = 0;
+            cdc_shell_write_string(cdc_shell_prompt);
+        }
+    }
+}
+
 static int cdc_shell_invoke_command(int argc, char *argv[], const cdc_shell_cmd_t *commands) {
     const cdc_shell_cmd_t *shell_cmd = commands;
     while (shell_cmd->cmd) {
@@ -71,6 +112,10 @@ static const char cdc_shell_err_uart_invalid_pull_type[]            = "Error, in
 static const char cdc_shell_err_cannot_set_output_type_for_input[]  = "Error, cannot set output type for input pin.\r\n";
 static const char cdc_shell_err_cannot_change_polarity[]            = "Error, cannot change polarity of alternate function pins.\r\n";
 static const char cdc_shell_err_cannot_set_pull_for_output[]        = "Error, cannot pull type for output pin.\r\n";
+static const char cdc_shell_err_uart_missing_latency[]              = "Error, missing latency timer value.\r\n";
+static const char cdc_shell_err_uart_invalid_latency[]              = "Error, invalid latency timer value.\r\n";
+static const char cdc_shell_err_uart_missing_buf_size[]             = "Error, missing buffer size.\r\n";
+static const char cdc_shell_err_uart_invalid_buf_size[]             = "Error, invalid buffer size or buffers do not fit in memory.\r\n";
 
 
 static const char *_cdc_uart_signal_names[cdc_pin_last] = {
@@ -135,46 +180,62 @@ static void cdc_shell_cmd_uart_show(int port) {
     const char *output_str = "output ";
     const char *comma_str = ", ";
     const char *colon_str = ":";
+    const char *latency_str = "latency";
+    const char *ms_str = " ms";
+    const char *buffers_str = "buffers";
+    const char *rx_str = "rx ";
+    const char *tx_str = ", tx ";
     char port_index_str[32];
-    for (int port_index = ((port == -1) ? 0 : port);
-             port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
-             port_index++) {
-        const cdc_port_t *cdc_port = &device_config_get()->cdc_config.port_config[port_index];
-        itoa(port_index+1, port_index_str, 10);
-        cdc_shell_write_string(uart_str);
-        cdc_shell_write_string(port_index_str);
-        cdc_shell_write_string(colon_str);
-        cdc_shell_write_string(cdc_shell_new_line);
-        for (cdc_pin_t pin = 0; pin < cdc_pin_last; pin++) {
-            const gpio_pin_t *cdc_pin = &cdc_port->pins[pin];
-            const char *pin_name = _cdc_uart_signal_names[pin];
-            cdc_shell_write_string(pin_name);
-            cdc_shell_write_string(cdc_shell_delim);
-            if (cdc_pin->port) {
-                const char *active_value = _cdc_uart_polarities[cdc_pin->polarity];
-                if (cdc_pin->dir == gpio_dir_input) {
-                    cdc_shell_write_string(in_str);
-                } else {
-                    cdc_shell_write_string(out_str);
-                }
-                cdc_shell_write_string(active_str);
-                cdc_shell_write_string(active_value);
-                cdc_shell_write_string(comma_str);
-                if (cdc_pin->dir == gpio_dir_input) {
-                    const char *pull_value = _cdc_uart_pull_types[cdc_pin->pull];
-                    cdc_shell_write_string(pull_str);
-                    cdc_shell_write_string(pull_value);
-                } else {
-                    const char *output_value = _cdc_uart_output_types[cdc_pin->output];
-                    cdc_shell_write_string(output_str);
-                    cdc_shell_write_string(output_value);
-                }
+    const cdc_port_t *cdc_port = &device_config_get()->cdc_config.port_config[port];
+    itoa(port+1, port_index_str, 10);
+    cdc_shell_write_string(uart_str);
+    cdc_shell_write_string(port_index_str);
+    cdc_shell_write_string(colon_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    for (cdc_pin_t pin = 0; pin < cdc_pin_last; pin++) {
+        const gpio_pin_t *cdc_pin = &cdc_port->pins[pin];
+        const char *pin_name = _cdc_uart_signal_names[pin];
+        cdc_shell_write_string(pin_name);
+        cdc_shell_write_string(cdc_shell_delim);
+        if (cdc_pin->port) {
+            const char *active_value = _cdc_uart_polarities[cdc_pin->polarity];
+            if (cdc_pin->dir == gpio_dir_input) {
+                cdc_shell_write_string(in_str);
             } else {
-                cdc_shell_write_string(na_str);
+                cdc_shell_write_string(out_str);
             }
-            cdc_shell_write_string(cdc_shell_new_line);
+            cdc_shell_write_string(active_str);
+            cdc_shell_write_string(active_value);
+            cdc_shell_write_string(comma_str);
+            if (cdc_pin->dir == gpio_dir_input) {
+                const char *pull_value = _cdc_uart_pull_types[cdc_pin->pull];
+                cdc_shell_write_string(pull_str);
+                cdc_shell_write_string(pull_value);
+            } else {
+                const char *output_value = _cdc_uart_output_types[cdc_pin->output];
+                cdc_shell_write_string(output_str);
+                cdc_shell_write_string(output_value);
+            }
+        } else {
+            cdc_shell_write_string(na_str);
         }
+        cdc_shell_write_string(cdc_shell_new_line);
     }
+    itoa(cdc_port->latency_timer, port_index_str, 10);
+    cdc_shell_write_string(latency_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(port_index_str);
+    cdc_shell_write_string(ms_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(buffers_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(rx_str);
+    itoa(cdc_port->rx_buf_size, port_index_str, 10);
+    cdc_shell_write_string(port_index_str);
+    cdc_shell_write_string(tx_str);
+    itoa(cdc_port->tx_buf_size, port_index_str, 10);
+    cdc_shell_write_string(port_index_str);
+    cdc_shell_write_string(cdc_shell_new_line);
 }
 
 static int cdc_shell_cmd_uart_set_output_type(int port, cdc_pin_t uart_pin, gpio_output_t output) {
@@ -225,6 +286,55 @@ static int cdc_shell_cmd_uart_set_pull_type(int port, cdc_pin_t uart_pin, gpio_p
     return 0;
 }
 
+static int cdc_shell_cmd_uart_set_latency_timer(int port, const char *value) {
+    char *value_end;
+    long latency_timer = strtol(value, &value_end, 10);
+    if ((*value == 0) || (*value_end != 0) || (latency_timer < 0) || (latency_timer > CDC_PORT_LATENCY_TIMER_MAX)) {
+        cdc_shell_write_string(cdc_shell_err_uart_invalid_latency);
+        return -1;
+    }
+    for (int port_index = ((port == -1) ? 0 : port);
+             port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+             port_index++) {
+        device_config_get()->cdc_config.port_config[port_index].latency_timer = latency_timer;
+    }
+    return 0;
+}
+
+static int cdc_shell_cmd_uart_set_buf_size(int port, int tx, const char *value) {
+    cdc_port_t *port_configs = device_config_get()->cdc_config.port_config;
+    size_t rx_buf_sizes[USB_CDC_NUM_PORTS];
+    size_t tx_buf_sizes[USB_CDC_NUM_PORTS];
+    char *value_end;
+    long buf_size = strtol(value, &value_end, 10);
+    if ((*value == 0) || (*value_end != 0) || (buf_size <= 0) || (buf_size > USB_CDC_BUF_ARENA_SIZE)) {
+        cdc_shell_write_string(cdc_shell_err_uart_invalid_buf_size);
+        return -1;
+    }
+    for (int port_index = 0; port_index < USB_CDC_NUM_PORTS; port_index++) {
+        rx_buf_sizes[port_index] = port_configs[port_index].rx_buf_size;
+        tx_buf_sizes[port_index] = port_configs[port_index].tx_buf_size;
+    }
+    for (int port_index = ((port == -1) ? 0 : port);
+             port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+             port_index++) {
+        if (tx) {
+            tx_buf_sizes[port_index] = buf_size;
+        } else {
+            rx_buf_sizes[port_index] = buf_size;
+        }
+    }
+    if (!usb_cdc_buf_sizes_valid(rx_buf_sizes, tx_buf_sizes)) {
+        cdc_shell_write_string(cdc_shell_err_uart_invalid_buf_size);
+        return -1;
+    }
+    for (int port_index = 0; port_index < USB_CDC_NUM_PORTS; port_index++) {
+        port_configs[port_index].rx_buf_size = rx_buf_sizes[port_index];
+        port_configs[port_index].tx_buf_size = tx_buf_sizes[port_index];
+    }
+    return 0;
+}
+
 static void cdc_shell_cmd_uart(int argc, char *argv[]) {
     if (argc--) {
         int port;
@@ -240,10 +350,41 @@ static void cdc_shell_cmd_uart(int argc, char *argv[]) {
         argv++;
         if (argc) {
             if (strcmp(*argv, "show") == 0) {
-                cdc_shell_cmd_uart_show(port);
+                if (port == -1) {
+                    cdc_shell_write_parts(cdc_shell_cmd_uart_show, 0, USB_CDC_NUM_PORTS - 1);
+                } else {
+                    cdc_shell_cmd_uart_show(port);
+                }
             } else {
                 while(argc) {
                     argc--;
+                    if (strcmp(*argv, "latency") == 0) {
+                        argv++;
+                        if (argc) {
+                            argc--;
+                            if (cdc_shell_cmd_uart_set_latency_timer(port, *argv++) == -1) {
+                                return;
+                            }
+                        } else {
+                            cdc_shell_write_string(cdc_shell_err_uart_missing_latency);
+                            return;
+                        }
+                        continue;
+                    }
+                    if ((strcmp(*argv, "rxbuf") == 0) || (strcmp(*argv, "txbuf") == 0)) {
+                        int tx = (strcmp(*argv, "txbuf") == 0);
+                        argv++;
+                        if (argc) {
+                            argc--;
+                            if (cdc_shell_cmd_uart_set_buf_size(port, tx, *argv++) == -1) {
+                                return;
+                            }
+                        } else {
+                            cdc_shell_write_string(cdc_shell_err_uart_missing_buf_size);
+                            return;
+                        }
+                        continue;
+                    }
                     cdc_pin_t uart_pin = _cdc_uart_signal_by_name(*argv);
                     if (uart_pin == cdc_pin_unknown) {
                         cdc_shell_write_string(cdc_shell_err_uart_unknown_signal);
@@ -327,6 +468,154 @@ static void cdc_shell_cmd_uart(int argc, char *argv[]) {
 }
 
 
+static void cdc_shell_write_stats_bytes(const char *name, uint32_t bytes, uint32_t rate) {
+    const char *comma_str = ", ";
+    const char *rate_str = " bytes/s";
+    char value_str[32];
+    cdc_shell_write_string(name);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(bytes, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(comma_str);
+    utoa(rate, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(rate_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_cmd_stats_port(int port) {
+    const char *uart_str = "UART";
+    const char *colon_str = ":";
+    const char *rx_bytes_str = "rx bytes";
+    const char *tx_bytes_str = "tx bytes";
+    const char *errors_str = "errors";
+    const char *overrun_str = "overrun ";
+#if !USB_CDC_BUF_POOL
+    const char *lost_str = ", lost ";
+#endif
+    const char *parity_str = ", parity ";
+    const char *framing_str = ", framing ";
+    const char *noise_str = ", noise ";
+    const char *buffers_peak_str = "buffers peak";
+    const char *rx_str = "rx ";
+    const char *tx_str = ", tx ";
+    const char *usb_out_naks_str = "usb out naks";
+#if USB_CDC_BUF_POOL
+    const char *rx_blocks_str = "rx blocks";
+    const char *peak_str = ", peak ";
+#endif
+    char value_str[32];
+    usb_cdc_port_stats_t stats;
+    usb_cdc_get_port_stats(port, &stats);
+    itoa(port + 1, value_str, 10);
+    cdc_shell_write_string(uart_str);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(colon_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_stats_bytes(rx_bytes_str, stats.rx_bytes, stats.rx_rate);
+    cdc_shell_write_stats_bytes(tx_bytes_str, stats.tx_bytes, stats.tx_rate);
+    cdc_shell_write_string(errors_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(stats.rx_overruns, value_str, 10);
+    cdc_shell_write_string(overrun_str);
+    cdc_shell_write_string(value_str);
+#if !USB_CDC_BUF_POOL
+    utoa(stats.rx_lost_bytes, value_str, 10);
+    cdc_shell_write_string(lost_str);
+    cdc_shell_write_string(value_str);
+#endif
+    utoa(stats.parity_errors, value_str, 10);
+    cdc_shell_write_string(parity_str);
+    cdc_shell_write_string(value_str);
+    utoa(stats.framing_errors, value_str, 10);
+    cdc_shell_write_string(framing_str);
+    cdc_shell_write_string(value_str);
+    utoa(stats.noise_errors, value_str, 10);
+    cdc_shell_write_string(noise_str);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(buffers_peak_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(stats.rx_peak, value_str, 10);
+    cdc_shell_write_string(rx_str);
+    cdc_shell_write_string(value_str);
+    utoa(stats.tx_peak, value_str, 10);
+    cdc_shell_write_string(tx_str);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(usb_out_naks_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(stats.usb_out_naks, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+#if USB_CDC_BUF_POOL
+    utoa(stats.rx_blocks, value_str, 10);
+    cdc_shell_write_string(rx_blocks_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(value_str);
+    utoa(stats.rx_blocks_peak, value_str, 10);
+    cdc_shell_write_string(peak_str);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+#endif
+}
+
+static void cdc_shell_cmd_stats_usb() {
+    const char *usb_str = "USB:";
+    const char *poll_passes_str = "poll passes";
+    const char *events_str = ", events ";
+    const char *ctr_str = ", ctr ";
+    const char *max_str = ", max ";
+    const char *pass_events_str = "events per pass";
+    const char *colon_str = ":";
+    const char *last_str = "+:";
+    const char *space_str = " ";
+    const usb_io_poll_stats_t *poll_stats = usb_io_get_poll_stats();
+    char value_str[32];
+    cdc_shell_write_string(usb_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(poll_passes_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(poll_stats->passes, value_str, 10);
+    cdc_shell_write_string(value_str);
+    utoa(poll_stats->events, value_str, 10);
+    cdc_shell_write_string(events_str);
+    cdc_shell_write_string(value_str);
+    utoa(poll_stats->ctr_events, value_str, 10);
+    cdc_shell_write_string(ctr_str);
+    cdc_shell_write_string(value_str);
+    utoa(poll_stats->max_pass_events, value_str, 10);
+    cdc_shell_write_string(max_str);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(pass_events_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    for (int events = 0; events < USB_IO_POLL_HISTOGRAM_SIZE; events++) {
+        if (events) {
+            cdc_shell_write_string(space_str);
+        }
+        utoa(events, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string((events == USB_IO_POLL_HISTOGRAM_SIZE - 1) ? last_str : colon_str);
+        utoa(poll_stats->pass_events[events], value_str, 10);
+        cdc_shell_write_string(value_str);
+    }
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+/* One part per port, the USB event dispatch counters come last */
+static void cdc_shell_cmd_stats_part(int part) {
+    if (part < USB_CDC_NUM_PORTS) {
+        cdc_shell_cmd_stats_port(part);
+    } else {
+        cdc_shell_cmd_stats_usb();
+    }
+}
+
+static void cdc_shell_cmd_stats(int argc, char *argv[]) {
+    cdc_shell_write_parts(cdc_shell_cmd_stats_part, 0, USB_CDC_NUM_PORTS);
+}
+
 static const char cdc_shell_err_config_missing_arguments[] = "Error, invalid or missing arguments, use \"help config\" for the list of arguments.\r\n";
 
 static void cdc_shell_cmd_config_save() {
@@ -350,6 +639,356 @@ static void cdc_shell_cmd_config(int argc, char *argv[]) {
     cdc_shell_write_string(cdc_shell_err_config_missing_arguments);
 }
 
+#if USB_CDC_RX_CAPTURE || USB_CDC_RX_ERROR_MARKS
+
+/* Port Mode Commands */
+
+static void cdc_shell_cmd_port_mode_show(int port, int (*get_port_mode)(int port)) {
+    const char *uart_str = "UART";
+    const char *on_str = "on";
+    const char *off_str = "off";
+    char value_str[8];
+    for (int port_index = ((port == -1) ? 0 : port);
+             port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+             port_index++) {
+        itoa(port_index + 1, value_str, 10);
+        cdc_shell_write_string(uart_str);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(cdc_shell_delim);
+        cdc_shell_write_string(get_port_mode(port_index) ? on_str : off_str);
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+static void cdc_shell_cmd_port_mode(int argc, char *argv[], int (*get_port_mode)(int port),
+                                    void (*set_port_mode)(int port, int enabled), const char *err_missing_arguments) {
+    int port = -1;
+    if (argc) {
+        if (strcmp(*argv, "all") != 0) {
+            if (((port = atoi(*argv)) < 1) || port > USB_CDC_NUM_PORTS) {
+                cdc_shell_write_string(cdc_shell_err_uart_invalid_uart);
+                return;
+            }
+            port = port - 1;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc == 0 || ((argc == 1) && strcmp(*argv, "show") == 0)) {
+        return cdc_shell_cmd_port_mode_show(port, get_port_mode);
+    }
+    if ((argc == 1) && ((strcmp(*argv, "on") == 0) || (strcmp(*argv, "off") == 0))) {
+        int enabled = (strcmp(*argv, "on") == 0);
+        for (int port_index = ((port == -1) ? 0 : port);
+                 port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+                 port_index++) {
+            set_port_mode(port_index, enabled);
+        }
+        return;
+    }
+    cdc_shell_write_string(err_missing_arguments);
+}
+
+#endif
+
+#if USB_CDC_RX_CAPTURE
+
+/* Capture Commands */
+
+static const char cdc_shell_err_capture_missing_arguments[] = "Error, invalid or missing arguments, use \"help capture\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_capture(int argc, char *argv[]) {
+    cdc_shell_cmd_port_mode(argc, argv, usb_cdc_get_port_rx_capture, usb_cdc_set_port_rx_capture,
+                            cdc_shell_err_capture_missing_arguments);
+}
+
+#endif /* USB_CDC_RX_CAPTURE */
+
+#if USB_CDC_RX_ERROR_MARKS
+
+/* Error Marks Commands */
+
+static const char cdc_shell_err_marks_missing_arguments[] = "Error, invalid or missing arguments, use \"help marks\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_marks(int argc, char *argv[]) {
+    cdc_shell_cmd_port_mode(argc, argv, usb_cdc_get_port_rx_error_marks, usb_cdc_set_port_rx_error_marks,
+                            cdc_shell_err_marks_missing_arguments);
+}
+
+#endif /* USB_CDC_RX_ERROR_MARKS */
+
+#if PERF_PROFILING
+
+/* Perf Commands */
+
+static const char cdc_shell_err_perf_missing_arguments[] = "Error, invalid or missing arguments, use \"help perf\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_perf_show() {
+    const char *calls_str = "calls ";
+    const char *min_str = ", min ";
+    const char *max_str = ", max ";
+    const char *mean_str = ", mean ";
+    char value_str[32];
+    for (perf_probe_t probe = 0; probe < perf_probe_last; probe++) {
+        perf_probe_stats_t stats;
+        perf_get_probe_stats(probe, &stats);
+        if (stats.count == 0) {
+            continue;
+        }
+        cdc_shell_write_string(perf_get_probe_name(probe));
+        cdc_shell_write_string(cdc_shell_delim);
+        cdc_shell_write_string(calls_str);
+        utoa(stats.count, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(min_str);
+        utoa(stats.min, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(max_str);
+        utoa(stats.max, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(mean_str);
+        utoa((uint32_t)(stats.total / stats.count), value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+static void cdc_shell_cmd_perf(int argc, char *argv[]) {
+    if (argc == 0 || ((argc == 1) && strcmp(*argv, "show") == 0)) {
+        return cdc_shell_cmd_perf_show();
+    }
+    if ((argc == 1) && strcmp(*argv, "reset") == 0) {
+        return perf_reset();
+    }
+    cdc_shell_write_string(cdc_shell_err_perf_missing_arguments);
+}
+
+#endif /* PERF_PROFILING */
+
+#if TRACE_RECORDER
+
+/* Trace Commands */
+
+#define CDC_SHELL_TRACE_DUMP_SIZE           0x100
+#define CDC_SHELL_TRACE_DUMP_LINE_SIZE      0x20
+
+static const char cdc_shell_err_trace_missing_arguments[] = "Error, invalid or missing arguments, use \"help trace\" for the list of arguments.\r\n";
+static const char cdc_shell_err_trace_recording[]         = "Error, stop recording before dumping the trace.\r\n";
+static const char cdc_shell_err_trace_invalid_offset[]    = "Error, invalid trace offset.\r\n";
+
+static void cdc_shell_write_hex(uint32_t value, int digits) {
+    static const char hex_digits[] = "0123456789abcdef";
+    char hex_str[8];
+    for (int i = digits - 1; i >= 0; i--) {
+        hex_str[i] = hex_digits[value & 0x0f];
+        value >>= 4;
+    }
+    cdc_shell_write(hex_str, digits);
+}
+
+static void cdc_shell_cmd_trace_show() {
+    const char *trace_str = "trace";
+    const char *recording_str = "recording";
+    const char *stopped_str = "stopped";
+    const char *records_str = "records";
+    const char *dropped_str = ", dropped ";
+    const char *bytes_str = "bytes";
+    const char *of_str = " of ";
+    char value_str[32];
+    trace_status_t status;
+    trace_get_status(&status);
+    cdc_shell_write_string(trace_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(status.recording ? recording_str : stopped_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(records_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(status.records, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(dropped_str);
+    utoa(status.dropped, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(bytes_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(status.size, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(of_str);
+    utoa(TRACE_BUF_SIZE, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_trace_dump_range(size_t offset, size_t end) {
+    const char *offset_delim = ": ";
+    const uint8_t *data = trace_data();
+    while (offset < end) {
+        cdc_shell_write_hex(offset, 4);
+        cdc_shell_write_string(offset_delim);
+        for (int i = 0; (i < CDC_SHELL_TRACE_DUMP_LINE_SIZE) && (offset < end); i++) {
+            cdc_shell_write_hex(data[offset++], 2);
+        }
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+/* One part per CDC_SHELL_TRACE_DUMP_SIZE bytes of the trace */
+static void cdc_shell_cmd_trace_dump_part(int part) {
+    trace_status_t status;
+    size_t offset = part * CDC_SHELL_TRACE_DUMP_SIZE;
+    size_t end = offset + CDC_SHELL_TRACE_DUMP_SIZE;
+    trace_get_status(&status);
+    if (end > status.size) {
+        end = status.size;
+    }
+    cdc_shell_trace_dump_range(offset, end);
+}
+
+static void cdc_shell_cmd_trace_dump(const char *value) {
+    trace_status_t status;
+    size_t offset = 0;
+    trace_get_status(&status);
+    if (status.recording) {
+        return cdc_shell_write_string(cdc_shell_err_trace_recording);
+    }
+    if (value) {
+        char *value_end;
+        long value_offset = strtol(value, &value_end, 0);
+        if (*value_end || value_offset < 0 || value_offset > status.size) {
+            return cdc_shell_write_string(cdc_shell_err_trace_invalid_offset);
+        }
+        offset = value_offset;
+        size_t end = offset + CDC_SHELL_TRACE_DUMP_SIZE;
+        if (end > status.size) {
+            end = status.size;
+        }
+        return cdc_shell_trace_dump_range(offset, end);
+    }
+    if (status.size) {
+        cdc_shell_write_parts(cdc_shell_cmd_trace_dump_part, 0, (status.size - 1) / CDC_SHELL_TRACE_DUMP_SIZE);
+    }
+}
+
+static void cdc_shell_cmd_trace(int argc, char *argv[]) {
+    if (argc == 0 || ((argc == 1) && strcmp(*argv, "show") == 0)) {
+        return cdc_shell_cmd_trace_show();
+    }
+    if (argc == 1) {
+        if (strcmp(*argv, "start") == 0) {
+            return trace_start();
+        }
+        if (strcmp(*argv, "stop") == 0) {
+            return trace_stop();
+        }
+        if (strcmp(*argv, "clear") == 0) {
+            return trace_clear();
+        }
+    }
+    if (((argc == 1) || (argc == 2)) && strcmp(*argv, "dump") == 0) {
+        return cdc_shell_cmd_trace_dump((argc == 2) ? argv[1] : 0);
+    }
+    cdc_shell_write_string(cdc_shell_err_trace_missing_arguments);
+}
+
+#endif /* TRACE_RECORDER */
+
+#if EVENT_TRACE
+
+/* Event Trace Commands */
+
+#define CDC_SHELL_EVENTS_DUMP_COUNT         16
+
+static const char cdc_shell_err_events_missing_arguments[] = "Error, invalid or missing arguments, use \"help events\" for the list of arguments.\r\n";
+static const char cdc_shell_err_events_running[]           = "Error, stop the event trace before dumping it.\r\n";
+static const char cdc_shell_err_events_invalid_index[]     = "Error, invalid event index.\r\n";
+
+static void cdc_shell_cmd_events_show() {
+    const char *events_str = "events";
+    const char *running_str = "running";
+    const char *stopped_str = "stopped";
+    const char *count_str = "count";
+    const char *kept_str = ", last ";
+    const char *kept_end_str = " kept";
+    char value_str[32];
+    cdc_shell_write_string(events_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(event_trace_running() ? running_str : stopped_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+    cdc_shell_write_string(count_str);
+    cdc_shell_write_string(cdc_shell_delim);
+    utoa(event_trace_count(), value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(kept_str);
+    utoa(EVENT_TRACE_SIZE, value_str, 10);
+    cdc_shell_write_string(value_str);
+    cdc_shell_write_string(kept_end_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_cmd_events_dump(const char *value) {
+    const char *field_delim = " ";
+    uint32_t count = event_trace_count();
+    uint32_t index = (count > EVENT_TRACE_SIZE) ? (count - EVENT_TRACE_SIZE) : 0;
+    char value_str[32];
+    if (event_trace_running()) {
+        return cdc_shell_write_string(cdc_shell_err_events_running);
+    }
+    if (value) {
+        char *value_end;
+        long value_index = strtol(value, &value_end, 0);
+        if (*value_end || value_index < index || value_index > count) {
+            return cdc_shell_write_string(cdc_shell_err_events_invalid_index);
+        }
+        index = value_index;
+    }
+    for (int i = 0; i < CDC_SHELL_EVENTS_DUMP_COUNT; i++, index++) {
+        event_trace_entry_t entry;
+        if (event_trace_get_entry(index, &entry) == -1) {
+            break;
+        }
+        utoa(index, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(cdc_shell_delim);
+        utoa(entry.timestamp, value_str, 10);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(field_delim);
+        cdc_shell_write_string(event_trace_get_name(entry.id));
+        if (entry.port != EVENT_TRACE_NO_PORT) {
+            const char *uart_str = " UART";
+            itoa(entry.port + 1, value_str, 10);
+            cdc_shell_write_string(uart_str);
+            cdc_shell_write_string(value_str);
+        }
+        utoa(entry.arg, value_str, 10);
+        cdc_shell_write_string(field_delim);
+        cdc_shell_write_string(value_str);
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+static void cdc_shell_cmd_events(int argc, char *argv[]) {
+    if (argc == 0 || ((argc == 1) && strcmp(*argv, "show") == 0)) {
+        return cdc_shell_cmd_events_show();
+    }
+    if (argc == 1) {
+        if (strcmp(*argv, "start") == 0) {
+            return event_trace_start();
+        }
+        if (strcmp(*argv, "stop") == 0) {
+            return event_trace_stop();
+        }
+        if (strcmp(*argv, "clear") == 0) {
+            return event_trace_clear();
+        }
+    }
+    if (((argc == 1) || (argc == 2)) && strcmp(*argv, "dump") == 0) {
+        return cdc_shell_cmd_events_dump((argc == 2) ? argv[1] : 0);
+    }
+    cdc_shell_write_string(cdc_shell_err_events_missing_arguments);
+}
+
+#endif /* EVENT_TRACE */
+
 static const char cdc_shell_device_version[]            = DEVICE_VERSION_STRING;
 
 static void cdc_shell_cmd_version(int argc, char *argv[]) {
@@ -386,9 +1025,76 @@ static const cdc_shell_cmd_t cdc_shell_commands[] = {
                           "  output\t[pp|od]\r\n"
                           "  active\t[low|high]\r\n"
                           "  pull\t\t[floating|up|down]\r\n"
+                          "Use \"uart port-number|all latency ms\" to hold received data for up to ms milliseconds\r\n"
+                          "until a full USB packet is ready, 0 sends received data right away.\r\n"
+                          "Use \"uart port-number|all rxbuf|txbuf bytes\" to set buffer sizes, powers of two\r\n"
+                          "from 128, 6144 bytes in total, applied after \"config save\" and restart.\r\n"
                           "Example: \"uart 1 tx output od\" sets UART1 TX output type to open-drain\r\n"
                           "Example: \"uart 3 rts active high dcd active high pull down\" allows to set multiple parameters at once.",
     },
+    {
+        .cmd            = "stats",
+        .handler        = cdc_shell_cmd_stats,
+        .description    = "show UART port and USB statistics",
+        .usage          = "Usage: stats",
+    },
+#if USB_CDC_RX_CAPTURE
+    {
+        .cmd            = "capture",
+        .handler        = cdc_shell_cmd_capture,
+        .description    = "send received UART data to the host as timestamped records",
+        .usage          = "Usage: capture [port-number|all] [show|on|off]\r\n"
+                          "Use \"capture port-number|all on\" to send received data as records, each one is\r\n"
+                          "a 32-bit timestamp in microseconds and a 16-bit size, little-endian, followed by the data.\r\n"
+                          "The capture mode is not saved by \"config save\".",
+    },
+#endif
+#if USB_CDC_RX_ERROR_MARKS
+    {
+        .cmd            = "marks",
+        .handler        = cdc_shell_cmd_marks,
+        .description    = "mark received UART bytes with parity and framing errors",
+        .usage          = "Usage: marks [port-number|all] [show|on|off]\r\n"
+                          "Use \"marks port-number|all on\" to send a bad byte X as 0xff 0x00 X, a break as\r\n"
+                          "0xff 0x00 0x00, and a good 0xff byte as 0xff 0xff, like the PARMRK termios flag.\r\n"
+                          "The marking mode is not saved by \"config save\".",
+    },
+#endif
+#if PERF_PROFILING
+    {
+        .cmd            = "perf",
+        .handler        = cdc_shell_cmd_perf,
+        .description    = "show CPU time spent in polling functions and interrupt handlers",
+        .usage          = "Usage: perf [show|reset]\r\n"
+                          "Use \"perf show\" to print call counts and min, max and mean CPU cycles per call,\r\n"
+                          "\"perf reset\" to reset the statistics.",
+    },
+#endif
+#if EVENT_TRACE
+    {
+        .cmd            = "events",
+        .handler        = cdc_shell_cmd_events,
+        .description    = "trace hot path events",
+        .usage          = "Usage: events [show|start|stop|clear|dump [index]]\r\n"
+                          "Use \"events start\" and \"events stop\" to start and stop tracing,\r\n"
+                          "\"events clear\" to discard the traced events.\r\n"
+                          "Use \"events dump index\" to print 16 events of the stopped trace starting at index,\r\n"
+                          "each as index, CPU cycle counter, event name, port and argument.",
+    },
+#endif
+#if TRACE_RECORDER
+    {
+        .cmd            = "trace",
+        .handler        = cdc_shell_cmd_trace,
+        .description    = "record USB and UART traffic",
+        .usage          = "Usage: trace [show|start|stop|clear|dump [offset]]\r\n"
+                          "Use \"trace start\" and \"trace stop\" to start and stop recording,\r\n"
+                          "\"trace clear\" to discard the recorded trace.\r\n"
+                          "Use \"trace dump\" to print the whole stopped trace in hex,\r\n"
+                          "\"trace dump offset\" to print 256 bytes of it starting at offset.\r\n"
+                          "Decode the dump on the host with the \"make trace-decode\" tool.",
+    },
+#endif
     {
         .cmd            = "version",
         .handler        = cdc_shell_cmd_version,
@@ -490,6 +1196,7 @@ void cdc_shell_init() {
     cdc_shell_clear_cmd_buf();
     memset(cmd_prev_line_buf, 0, sizeof(cmd_prev_line_buf));
     cdc_shell_state = cdc_shell_idle;
+    cdc_shell_part_func = 0;
     cdc_shell_write_string(cdc_shell_banner);
     cdc_shell_write_string(cdc_shell_prompt);
 }
@@ -533,9 +1240,9 @@ static void cdc_shell_insert_symbol(char c) {
     cdc_shell_cursor_move_back(strlen(cmd_line_buf) - (cmd_line_cursor - cmd_line_buf));
 }
 
-void cdc_shell_process_input(const void *buf, size_t count) {
+size_t cdc_shell_process_input(const void *buf, size_t count) {
     const char *buf_p= buf;
-    while (count--) {
+    while (!cdc_shell_busy() && count--) {
         switch (cdc_shell_state) {
         case cdc_shell_expects_csn:
             if (isdigit(*(unsigned char*)buf_p)) {
@@ -584,7 +1291,9 @@ void cdc_shell_process_input(const void *buf, size_t count) {
                 }
                 cdc_shell_parse_command_line(cmd_line_buf);
                 cdc_shell_clear_cmd_buf();
-                cdc_shell_write_string(cdc_shell_prompt);
+                if (!cdc_shell_busy()) {
+                    cdc_shell_write_string(cdc_shell_prompt);
+                }
             } else if (*buf_p == ANSI_CTRLSEQ_ESCAPE_CHAR) {
                 cdc_shell_state = cdc_shell_expects_csi;
             } else if (*buf_p == ASCII_BACKSPACE_CHAR || *buf_p == ASCII_DELETE_CHAR) {
@@ -601,4 +1310,5 @@ void cdc_shell_process_input(const void *buf, size_t count) {
         }
         buf_p++;
     }
+    return buf_p - (const char *)buf;
 }
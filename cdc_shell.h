@@ -15,6 +15,15 @@
 extern void cdc_shell_write(const void *buf, size_t count);
 
 void cdc_shell_init();
-void cdc_shell_process_input(const void *buf, size_t count);
+
+/*
+ * Commands with long output print it in parts, cdc_shell_poll prints the next
+ * part once the previous one is sent. While the shell is busy, no input is taken,
+ * cdc_shell_process_input returns the number of bytes processed.
+ */
+
+size_t cdc_shell_process_input(const void *buf, size_t count);
+int cdc_shell_busy();
+void cdc_shell_poll();
 
 #endif /* CDC_SHELL_H */
@@ -0,0 +1,31 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <limits.h>
+#include <stm32f1xx.h>
+#include "crc.h"
+
+uint32_t crc_calc(const void *data, size_t size) {
+    uint32_t *word_p = (uint32_t*)data;
+    size_t bytes_left = size;
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+    CRC->CR |= CRC_CR_RESET;
+    while (bytes_left > sizeof(*word_p)) {
+        CRC->DR = *word_p++;
+        bytes_left -= sizeof(*word_p);
+    }
+    if (bytes_left) {
+        uint32_t shift = 0;
+        uint32_t tail = 0;
+        uint8_t *byte_p = (uint8_t*)word_p;
+        for (int i = 0; i < bytes_left; i++) {
+            tail |= (uint32_t)(*byte_p++) << (shift);
+            shift += CHAR_BIT;
+        }
+        CRC->DR = tail;
+    }
+    return CRC->DR;
+}
@@ -0,0 +1,23 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC Calculation Unit
+ *
+ * CRC-32 with the polynomial 0x04C11DB7 and the initial value 0xFFFFFFFF,
+ * fed with 32-bit little-endian words, most significant bit first, without
+ * a final XOR. Trailing bytes are zero-extended to a last word.
+ */
+
+uint32_t crc_calc(const void *data, size_t size);
+
+#endif /* CRC_H */
@@ -6,7 +6,7 @@
 
 #include <string.h>
 #include <stm32f1xx.h>
-#include <limits.h>
+#include "crc.h"
 #include "device_config.h"
 
 #define DEVICE_CONFIG_FLASH_SIZE    0x10000UL
@@ -14,7 +14,23 @@
 #define DEVICE_CONFIG_PAGE_SIZE     0x400UL
 #define DEVICE_CONFIG_FLASH_END     (FLASH_BASE + DEVICE_CONFIG_FLASH_SIZE)
 #define DEVICE_CONFIG_BASE_ADDR     ((void*)(DEVICE_CONFIG_FLASH_END - DEVICE_CONFIG_NUM_PAGES * DEVICE_CONFIG_PAGE_SIZE))
-#define DEVICE_CONFIG_MAGIC         0xDECFDECFUL
+#define DEVICE_CONFIG_MAGIC         0xDECF0002UL
+#define DEVICE_CONFIG_MAGIC_V1      0xDECFDECFUL
+
+/*
+ * Layout stored by firmware versions without the per-port latency timer
+ * and buffer sizes, migrated on load with the defaults for the new fields
+ */
+
+typedef struct {
+    uint32_t        magic;
+    gpio_pin_t      status_led_pin;
+    gpio_pin_t      config_pin;
+    struct {
+        gpio_pin_t  pins[cdc_pin_last];
+    } __attribute__ ((packed)) port_config[USB_CDC_NUM_PORTS];
+    uint32_t        crc;
+} __attribute__ ((packed, aligned(4))) device_config_v1_t;
 
 static const device_config_t default_device_config = {
     .status_led_pin = { .port = GPIOC, .pin = 13, .dir = gpio_dir_output, .speed = gpio_speed_low, .func = gpio_func_general, .output = gpio_output_od, .polarity = gpio_polarity_low },
@@ -34,7 +50,10 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin = 15, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOB, .pin =  3, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOB, .pin =  0, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .latency_timer = 0,
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
             /*  Port 1 */
             {
@@ -49,7 +68,10 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin =  8, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOB, .pin = 12, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOB, .pin =  1, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .latency_timer = 0,
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
             /*  Port 2 */
             {
@@ -64,7 +86,10 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin =  9, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOA, .pin =  8, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOA, .pin =  7, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .latency_timer = 0,
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
         }
     }
@@ -72,48 +97,46 @@ static const device_config_t default_device_config = {
 
 static device_config_t current_device_config;
 
-static uint32_t device_config_calc_crc(const device_config_t *device_config) {
-    uint32_t *word_p = (uint32_t*)device_config;
-    size_t bytes_left = offsetof(device_config_t, crc);
-    CRC->CR |= CRC_CR_RESET;
-    while (bytes_left > sizeof(*word_p)) {
-        CRC->DR = *word_p++;
-        bytes_left -= sizeof(*word_p);
+/* Returns the layout magic of a valid config stored in the page, 0 if there is none */
+static uint32_t device_config_page_magic(const uint8_t *config_page) {
+    const device_config_t *stored_config = (device_config_t*)config_page;
+    const device_config_v1_t *stored_config_v1 = (device_config_v1_t*)config_page;
+    if ((stored_config->magic == DEVICE_CONFIG_MAGIC) &&
+        (crc_calc(stored_config, offsetof(device_config_t, crc)) == stored_config->crc)) {
+        return DEVICE_CONFIG_MAGIC;
     }
-    if (bytes_left) {
-        uint32_t shift = 0;
-        uint32_t tail = 0;
-        uint8_t *byte_p = (uint8_t*)word_p;
-        for (int i = 0; i < bytes_left; i++) {
-            tail |= (uint32_t)(*byte_p++) << (shift);
-            shift += CHAR_BIT;
-        }
-        CRC->DR = tail;
+    if ((stored_config_v1->magic == DEVICE_CONFIG_MAGIC_V1) &&
+        (crc_calc(stored_config_v1, offsetof(device_config_v1_t, crc)) == stored_config_v1->crc)) {
+        return DEVICE_CONFIG_MAGIC_V1;
+    }
+    return 0;
+}
+
+static void device_config_migrate_v1(const device_config_v1_t *stored_config) {
+    memcpy(&current_device_config, &default_device_config, sizeof(default_device_config));
+    current_device_config.status_led_pin = stored_config->status_led_pin;
+    current_device_config.config_pin = stored_config->config_pin;
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        memcpy(current_device_config.cdc_config.port_config[port].pins,
+               stored_config->port_config[port].pins, sizeof(stored_config->port_config[port].pins));
     }
-    return CRC->DR;
 }
 
-const static device_config_t* device_config_get_stored() {
+void device_config_init() {
     uint8_t *config_page = (uint8_t*)DEVICE_CONFIG_BASE_ADDR;
     size_t config_pages = DEVICE_CONFIG_NUM_PAGES;
     while (config_pages--) {
-        const device_config_t *stored_config = (device_config_t*)config_page;
-        if ((stored_config->magic == DEVICE_CONFIG_MAGIC) &&
-            (device_config_calc_crc(stored_config) == stored_config->crc)) {
-            return stored_config;
+        switch (device_config_page_magic(config_page)) {
+        case DEVICE_CONFIG_MAGIC:
+            memcpy(&current_device_config, config_page, sizeof(current_device_config));
+            return;
+        case DEVICE_CONFIG_MAGIC_V1:
+            device_config_migrate_v1((device_config_v1_t*)config_page);
+            return;
         }
         config_page += DEVICE_CONFIG_PAGE_SIZE;
     }
-    return 0;
-}
-
-void device_config_init() {
-    RCC->AHBENR |= RCC_AHBENR_CRCEN;
-    const device_config_t *stored_config = device_config_get_stored();
-    if (stored_config == 0) {
-        stored_config = &default_device_config;
-    }
-    memcpy(&current_device_config, stored_config, sizeof(*stored_config));
+    memcpy(&current_device_config, &default_device_config, sizeof(default_device_config));
 }
 device_config_t *device_config_get() {
     return &current_device_config;
@@ -127,10 +150,8 @@ void device_config_save() {
     uint16_t *dst_word_p;
     size_t bytes_left = sizeof(current_device_config);
     while (config_pages-- && (last_config_magic == 0)) {
-        const device_config_t *stored_config = (device_config_t*)config_page;
-        if ((stored_config->magic == DEVICE_CONFIG_MAGIC) &&
-            (device_config_calc_crc(stored_config) == stored_config->crc)) {
-            last_config_magic = (uint16_t*)&stored_config->magic;
+        if (device_config_page_magic(config_page)) {
+            last_config_magic = (uint16_t*)config_page;
         }
         config_page += DEVICE_CONFIG_PAGE_SIZE;
     }
@@ -151,7 +172,7 @@ void device_config_save() {
     FLASH->SR = FLASH_SR_EOP;
     FLASH->CR &= ~FLASH_CR_PER;
     current_device_config.magic = DEVICE_CONFIG_MAGIC;
-    current_device_config.crc = device_config_calc_crc(&current_device_config);
+    current_device_config.crc = crc_calc(&current_device_config, offsetof(device_config_t, crc));
     FLASH->CR |= FLASH_CR_PG;
     while (bytes_left > 1) {
         *dst_word_p++ = *src_word_p++;
@@ -0,0 +1,79 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <stm32f1xx.h>
+#include "system_time.h"
+#include "event_trace.h"
+
+#if EVENT_TRACE
+
+static const char *event_trace_names[event_trace_last] = {
+    [event_trace_usb_poll]              = "usb_poll",
+    [event_trace_start_tx]              = "start_tx",
+    [event_trace_extend_tx]             = "extend_tx",
+    [event_trace_dma_tx_complete]       = "dma_tx_complete",
+    [event_trace_line_coding_pending]   = "line_coding_pending",
+    [event_trace_line_coding_set]       = "line_coding_set",
+    [event_trace_rts]                   = "rts",
+    [event_trace_usb_out_hold]          = "usb_out_hold",
+    [event_trace_usb_out_resume]        = "usb_out_resume",
+};
+
+static struct {
+    event_trace_entry_t entries[EVENT_TRACE_SIZE];
+    volatile uint32_t   head;
+    volatile int        running;
+} event_trace;
+
+void event_trace_start() {
+    event_trace.running = 1;
+}
+
+void event_trace_stop() {
+    event_trace.running = 0;
+}
+
+void event_trace_clear() {
+    event_trace.running = 0;
+    event_trace.head = 0;
+}
+
+int event_trace_running() {
+    return event_trace.running;
+}
+
+const char *event_trace_get_name(event_trace_id_t id) {
+    if (id < event_trace_last) {
+        return event_trace_names[id];
+    }
+    return 0;
+}
+
+uint32_t event_trace_count() {
+    return event_trace.head;
+}
+
+int event_trace_get_entry(uint32_t index, event_trace_entry_t *entry) {
+    uint32_t head = event_trace.head;
+    if ((index >= head) || (head - index > EVENT_TRACE_SIZE)) {
+        return -1;
+    }
+    *entry = event_trace.entries[index & (EVENT_TRACE_SIZE - 1)];
+    return 0;
+}
+
+void event_trace_write(event_trace_id_t id, uint8_t port, uint16_t arg) {
+    if (event_trace.running) {
+        uint32_t index = __sync_fetch_and_add(&event_trace.head, 1);
+        event_trace_entry_t *entry = &event_trace.entries[index & (EVENT_TRACE_SIZE - 1)];
+        entry->timestamp = system_time_cycles();
+        entry->id = id;
+        entry->port = port;
+        entry->arg = arg;
+    }
+}
+
+#endif /* EVENT_TRACE */
@@ -0,0 +1,74 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Event Trace
+ *
+ * With EVENT_TRACE, hot path events are written to a ring of EVENT_TRACE_SIZE
+ * fixed-size entries, overwriting the oldest ones. Writing an entry is lock-free,
+ * so events are written from interrupt handlers as well. The trace is started,
+ * stopped and dumped at runtime with the "events" shell command.
+ */
+
+#ifndef EVENT_TRACE
+#define EVENT_TRACE         0
+#endif
+
+#ifndef EVENT_TRACE_SIZE
+#define EVENT_TRACE_SIZE    256 /* Entries, power of two */
+#endif
+
+#define EVENT_TRACE_NO_PORT 0xff
+
+typedef enum {
+    event_trace_usb_poll,               /* arg: USB events handled */
+    event_trace_start_tx,               /* arg: bytes passed to the TX DMA, 0 when waiting for the last byte */
+    event_trace_extend_tx,              /* arg: bytes passed to the TX DMA, USB_CDC_TX_DMA_EXTEND only */
+    event_trace_dma_tx_complete,        /* arg: bytes sent by the TX DMA */
+    event_trace_line_coding_pending,    /* arg: baud rate / 100, set when the TX data before it are sent */
+    event_trace_line_coding_set,        /* arg: baud rate / 100 */
+    event_trace_rts,                    /* arg: RTS output active */
+    event_trace_usb_out_hold,           /* arg: 1 - TX buffer full */
+    event_trace_usb_out_resume,         /* arg: bytes read */
+    event_trace_last
+} __attribute__ ((packed)) event_trace_id_t;
+
+#define EVENT_TRACE_OUT_HOLD_TX_BUF_FULL        0x01
+
+typedef struct {
+    uint32_t    timestamp;  /* CPU clock cycles */
+    uint8_t     id;
+    uint8_t     port;
+    uint16_t    arg;
+} __attribute__ ((packed)) event_trace_entry_t;
+
+#if EVENT_TRACE
+
+void event_trace_start();
+void event_trace_stop();
+void event_trace_clear();
+int event_trace_running();
+const char *event_trace_get_name(event_trace_id_t id);
+
+/* Entries are numbered from the last clear, the last EVENT_TRACE_SIZE entries are kept */
+uint32_t event_trace_count();
+int event_trace_get_entry(uint32_t index, event_trace_entry_t *entry);
+
+void event_trace_write(event_trace_id_t id, uint8_t port, uint16_t arg);
+
+#else
+
+#define event_trace_write(id, port, arg)        do { } while (0)
+
+#endif
+
+#endif /* EVENT_TRACE_H */
@@ -7,6 +7,7 @@
 #include <stm32f1xx.h>
 #include "system_clock.h"
 #include "system_interrupts.h"
+#include "system_time.h"
 #include "status_led.h"
 #include "device_config.h"
 #include "usb.h"
@@ -14,6 +15,7 @@
 int main() {
     system_clock_init();
     system_interrupts_init();
+    system_time_init();
     device_config_init();
     status_led_init();
     usb_init();
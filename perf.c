@@ -0,0 +1,72 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <string.h>
+#include <stm32f1xx.h>
+#include "perf.h"
+
+#if PERF_PROFILING
+
+static const char *perf_probe_names[perf_probe_last] = {
+    [perf_probe_usb_poll]       = "usb_poll",
+    [perf_probe_usb_cdc_poll]   = "usb_cdc_poll",
+    [perf_probe_dma1_ch1]       = "dma1_ch1",
+    [perf_probe_dma1_ch2]       = "dma1_ch2",
+    [perf_probe_dma1_ch3]       = "dma1_ch3",
+    [perf_probe_dma1_ch4]       = "dma1_ch4",
+    [perf_probe_dma1_ch5]       = "dma1_ch5",
+    [perf_probe_dma1_ch6]       = "dma1_ch6",
+    [perf_probe_dma1_ch7]       = "dma1_ch7",
+    [perf_probe_usart1]         = "usart1",
+    [perf_probe_usart2]         = "usart2",
+    [perf_probe_usart3]         = "usart3",
+    [perf_probe_pma_write]      = "pma_write",
+    [perf_probe_pma_read]       = "pma_read",
+};
+
+static perf_probe_stats_t perf_probe_stats[perf_probe_last];
+
+void perf_reset() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memset(perf_probe_stats, 0, sizeof(perf_probe_stats));
+    __set_PRIMASK(primask);
+}
+
+const char *perf_get_probe_name(perf_probe_t probe) {
+    if (probe < perf_probe_last) {
+        return perf_probe_names[probe];
+    }
+    return 0;
+}
+
+void perf_get_probe_stats(perf_probe_t probe, perf_probe_stats_t *stats) {
+    if (probe < perf_probe_last) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        *stats = perf_probe_stats[probe];
+        __set_PRIMASK(primask);
+    }
+}
+
+/* Probes of the same kind can preempt each other, the update is done with interrupts masked */
+void perf_probe_end(perf_probe_t probe, uint32_t start) {
+    uint32_t cycles = system_time_cycles() - start;
+    perf_probe_stats_t *stats = &perf_probe_stats[probe];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if ((stats->count == 0) || (cycles < stats->min)) {
+        stats->min = cycles;
+    }
+    if (cycles > stats->max) {
+        stats->max = cycles;
+    }
+    stats->total += cycles;
+    stats->count++;
+    __set_PRIMASK(primask);
+}
+
+#endif /* PERF_PROFILING */
@@ -0,0 +1,67 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include "system_time.h"
+
+/*
+ * CPU Time Profiling
+ *
+ * With PERF_PROFILING, the polling functions, the DMA and USART interrupt
+ * handlers and the packet memory copy routines are timed with the DWT cycle
+ * counter. The time of a probe includes the time spent in the interrupts
+ * preempting it. The statistics are shown and reset with the "perf" shell command.
+ */
+
+#ifndef PERF_PROFILING
+#define PERF_PROFILING      0
+#endif
+
+typedef enum {
+    perf_probe_usb_poll,        /* usb_poll, or the USB interrupt when interrupt-driven */
+    perf_probe_usb_cdc_poll,
+    perf_probe_dma1_ch1,
+    perf_probe_dma1_ch2,
+    perf_probe_dma1_ch3,
+    perf_probe_dma1_ch4,
+    perf_probe_dma1_ch5,
+    perf_probe_dma1_ch6,
+    perf_probe_dma1_ch7,
+    perf_probe_usart1,
+    perf_probe_usart2,
+    perf_probe_usart3,
+    perf_probe_pma_write,
+    perf_probe_pma_read,
+    perf_probe_last
+} __attribute__ ((packed)) perf_probe_t;
+
+typedef struct {
+    uint32_t    count;
+    uint32_t    min;
+    uint32_t    max;
+    uint64_t    total;
+} perf_probe_stats_t;
+
+#if PERF_PROFILING
+
+void perf_reset();
+const char *perf_get_probe_name(perf_probe_t probe);
+void perf_get_probe_stats(perf_probe_t probe, perf_probe_stats_t *stats);
+void perf_probe_end(perf_probe_t probe, uint32_t start);
+
+#define perf_probe_begin()              system_time_cycles()
+
+#else
+
+#define perf_probe_begin()              0
+#define perf_probe_end(probe, start)    ((void)(start))
+
+#endif
+
+#endif /* PERF_H */
@@ -5,6 +5,7 @@
 
 #define SYSTEM_INTERRUPTS_PRIORITY_GROUPING     0x02 /* 2 bits preemption, 2 bits sub-priority */
 
+#define SYSTEM_INTERRUTPS_PRIORITY_LOW          (NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 3, 0))
 #define SYSTEM_INTERRUTPS_PRIORITY_BASE         (NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 2, 0))
 #define SYSTEM_INTERRUTPS_PRIORITY_HIGH         (NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 1, 0))
 #define SYSTEM_INTERRUTPS_PRIORITY_CRITICAL     (NVIC_EncodePriority(NVIC_GetPriorityGrouping(), 0, 0))
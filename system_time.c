@@ -0,0 +1,108 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <stdlib.h>
+#include <stm32f1xx.h>
+#include "system_interrupts.h"
+#include "system_time.h"
+
+static struct {
+    volatile uint64_t   ms;
+    uint32_t            load;
+    system_time_sof_t   last_sof;
+#if SYSTEM_TIME_SOF_DISCIPLINE
+    int32_t             trim;
+    uint64_t            window_start;
+    uint32_t            window_frames;
+#endif
+} system_time;
+
+void system_time_init() {
+    system_time.load = (SystemCoreClock / 1000) - 1;
+    SysTick->LOAD = system_time.load;
+    SysTick->VAL = 0;
+    NVIC_SetPriority(SysTick_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint64_t system_time_now() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint64_t ms = system_time.ms;
+    uint32_t load = SysTick->LOAD;
+    uint32_t val = SysTick->VAL;
+    /* The counter has been reloaded, but the interrupt is not handled yet */
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+        val = SysTick->VAL;
+        ms++;
+    }
+    __set_PRIMASK(primask);
+    return (ms * 1000) + (((load - val) * 1000) / (load + 1));
+}
+
+void SysTick_Handler() {
+    (void)SysTick_Handler;
+    system_time.ms++;
+}
+
+/* USB SOF Hook */
+
+#if SYSTEM_TIME_SOF_DISCIPLINE
+
+/*
+ * Compares the time elapsed over a window of consecutive frames with the host
+ * frame clock and trims the SysTick period by the measured error.
+ * Windows with missing frames or an implausible error are discarded.
+ */
+
+static void system_time_discipline(uint64_t now, uint16_t frame) {
+    uint16_t expected_frame = (system_time.last_sof.frame + 1) & USB_FNR_FN;
+    if ((frame != expected_frame) || !(USB->FNR & USB_FNR_LCK) || (system_time.window_frames == 0)) {
+        system_time.window_start = now;
+        system_time.window_frames = 1;
+        return;
+    }
+    if (++system_time.window_frames > SYSTEM_TIME_SOF_WINDOW) {
+        int32_t window_time = SYSTEM_TIME_SOF_WINDOW * 1000;
+        int32_t error = (int32_t)(now - system_time.window_start) - window_time;
+        if (abs(error) < (window_time * SYSTEM_TIME_MAX_TRIM_PPM / 1000000)) {
+            int32_t max_trim = (system_time.load + 1) * SYSTEM_TIME_MAX_TRIM_PPM / 1000000;
+            int32_t cycles_per_us = (system_time.load + 1) / 1000;
+            int32_t correction = (error * cycles_per_us + (error < 0 ? -1 : 1) * (SYSTEM_TIME_SOF_WINDOW / 2)) /
+                                 SYSTEM_TIME_SOF_WINDOW;
+            system_time.trim += correction;
+            if (system_time.trim > max_trim) {
+                system_time.trim = max_trim;
+            } else if (system_time.trim < -max_trim) {
+                system_time.trim = -max_trim;
+            }
+            SysTick->LOAD = system_time.load + system_time.trim;
+        }
+        system_time.window_start = now;
+        system_time.window_frames = 1;
+    }
+}
+
+#endif
+
+void system_time_sof() {
+    uint64_t now = system_time_now();
+    uint16_t frame = USB->FNR & USB_FNR_FN;
+#if SYSTEM_TIME_SOF_DISCIPLINE
+    system_time_discipline(now, frame);
+#endif
+    system_time.last_sof.time = now;
+    system_time.last_sof.frame = frame;
+}
+
+void system_time_get_last_sof(system_time_sof_t *sof) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *sof = system_time.last_sof;
+    __set_PRIMASK(primask);
+}
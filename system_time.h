@@ -0,0 +1,51 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef SYSTEM_TIME_H
+#define SYSTEM_TIME_H
+
+#include <stdint.h>
+#include <stm32f1xx.h>
+
+/*
+ * System Timebase
+ *
+ * A free-running microsecond timebase, SysTick interrupts every millisecond
+ * extend it to 64 bits. system_time_now() can be called from any context.
+ *
+ * The time of the last USB SOF and its frame number are latched,
+ * so device timestamps can be correlated with host frame numbers.
+ * With SYSTEM_TIME_SOF_DISCIPLINE, the SysTick period is also trimmed
+ * every SYSTEM_TIME_SOF_WINDOW frames to follow the host frame clock.
+ *
+ * system_time_init() also starts the DWT cycle counter, system_time_cycles()
+ * is the timestamp of the trace recorder, the event trace and the perf probes.
+ * It wraps every 2^32 CPU cycles, about 60 seconds at 72 MHz.
+ */
+
+#ifndef SYSTEM_TIME_SOF_DISCIPLINE
+#define SYSTEM_TIME_SOF_DISCIPLINE      0
+#endif
+
+#define SYSTEM_TIME_SOF_WINDOW          1024 /* frames */
+#define SYSTEM_TIME_MAX_TRIM_PPM        500
+
+typedef struct {
+    uint64_t    time;   /* us */
+    uint16_t    frame;
+} system_time_sof_t;
+
+void system_time_init();
+uint64_t system_time_now();
+
+#define system_time_cycles()            (DWT->CYCCNT)
+
+/* USB SOF Hook */
+
+void system_time_sof();
+void system_time_get_last_sof(system_time_sof_t *sof);
+
+#endif /* SYSTEM_TIME_H */
@@ -0,0 +1,96 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <string.h>
+#include <stm32f1xx.h>
+#include "system_time.h"
+#include "trace.h"
+
+#if TRACE_RECORDER
+
+/* Trace Buffer */
+
+static struct {
+    uint8_t             data[TRACE_BUF_SIZE] __attribute__ ((aligned(4)));
+    volatile size_t     head;
+    uint32_t            start_cycles;
+    volatile int        recording;
+    volatile uint32_t   records;
+    volatile uint32_t   dropped;
+} trace;
+
+void trace_start() {
+    if (trace.head == 0) {
+        trace.start_cycles = system_time_cycles();
+    }
+    trace.recording = 1;
+}
+
+void trace_stop() {
+    trace.recording = 0;
+}
+
+void trace_clear() {
+    trace.recording = 0;
+    trace.head = 0;
+    trace.records = 0;
+    trace.dropped = 0;
+}
+
+void trace_get_status(trace_status_t *status) {
+    status->recording = trace.recording;
+    status->size = trace.head;
+    status->records = trace.records;
+    status->dropped = trace.dropped;
+}
+
+const uint8_t *trace_data() {
+    return trace.data;
+}
+
+/* Trace Records */
+
+void *trace_record_alloc(trace_record_type_t type, uint8_t channel, size_t size) {
+    size_t record_size = (sizeof(trace_record_t) + size + 3) & ~3;
+    uint32_t timestamp = system_time_cycles() - trace.start_cycles;
+    trace_record_t *record;
+    size_t head;
+    if (!trace.recording) {
+        return 0;
+    }
+    /* Records are allocated from the USB interrupts and the main loop alike */
+    do {
+        head = trace.head;
+        if (head + record_size > TRACE_BUF_SIZE) {
+            __sync_fetch_and_add(&trace.dropped, 1);
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&trace.head, head, head + record_size));
+    record = (trace_record_t*)&trace.data[head];
+    record->timestamp = timestamp;
+    record->type = type;
+    record->channel = channel;
+    record->size = size;
+    __sync_fetch_and_add(&trace.records, 1);
+    return record->payload;
+}
+
+void trace_record(trace_record_type_t type, uint8_t channel, const void *data, size_t size) {
+    trace_record_spans(type, channel, data, size, 0, 0);
+}
+
+void trace_record_spans(trace_record_type_t type, uint8_t channel,
+                        const void *span, size_t span_size, const void *wrap_span, size_t wrap_span_size) {
+    uint8_t *payload = trace_record_alloc(type, channel, span_size + wrap_span_size);
+    if (payload) {
+        memcpy(payload, span, span_size);
+        if (wrap_span_size) {
+            memcpy(payload + span_size, wrap_span, wrap_span_size);
+        }
+    }
+}
+
+#endif /* TRACE_RECORDER */
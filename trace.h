@@ -0,0 +1,85 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traffic Trace Recorder
+ *
+ * With TRACE_RECORDER, USB packets, received UART data and control line
+ * changes are recorded to a RAM buffer of TRACE_BUF_SIZE bytes. Recording is
+ * started and stopped with the "trace" shell command, which also dumps the
+ * trace. Records which do not fit in the buffer are dropped and counted.
+ *
+ * Trace records are stored back to back, each one starting at a 4-byte
+ * boundary, all fields are little-endian:
+ *
+ *   uint32_t   timestamp   CPU clock cycles since recording started
+ *   uint8_t    type        trace_record_type_t
+ *   uint8_t    channel     endpoint number or UART port index
+ *   uint16_t   size        payload size in bytes
+ *   uint8_t    payload[size]
+ */
+
+#ifndef TRACE_RECORDER
+#define TRACE_RECORDER      0
+#endif
+
+#ifndef TRACE_BUF_SIZE
+#define TRACE_BUF_SIZE      0x800
+#endif
+
+typedef enum {
+    trace_record_setup          = 0x01, /* SETUP packet */
+    trace_record_out            = 0x02, /* OUT packet */
+    trace_record_in             = 0x03, /* IN packet */
+    trace_record_uart_rx        = 0x04, /* Received UART data queued for the USB */
+    trace_record_control_lines  = 0x05, /* DTR/RTS set by the host, uint16_t */
+    trace_record_serial_state   = 0x06, /* Serial state sent to the host, usb_cdc_serial_state_t */
+    trace_record_line_coding    = 0x07, /* Line coding set by the host, usb_cdc_line_coding_t */
+} __attribute__ ((packed)) trace_record_type_t;
+
+typedef struct {
+    uint32_t    timestamp;
+    uint8_t     type;
+    uint8_t     channel;
+    uint16_t    size;
+    uint8_t     payload[0];
+} __attribute__ ((packed)) trace_record_t;
+
+typedef struct {
+    int         recording;
+    size_t      size;
+    uint32_t    records;
+    uint32_t    dropped;
+} trace_status_t;
+
+#if TRACE_RECORDER
+
+void trace_start();
+void trace_stop();
+void trace_clear();
+void trace_get_status(trace_status_t *status);
+const uint8_t *trace_data();
+
+/* Returns the payload of the new record to be filled by the caller, or 0 */
+void *trace_record_alloc(trace_record_type_t type, uint8_t channel, size_t size);
+void trace_record(trace_record_type_t type, uint8_t channel, const void *data, size_t size);
+void trace_record_spans(trace_record_type_t type, uint8_t channel,
+                        const void *span, size_t span_size, const void *wrap_span, size_t wrap_span_size);
+
+#else
+
+#define trace_record(type, channel, data, size)                 do { } while (0)
+#define trace_record_spans(type, channel, span, span_size, wrap_span, wrap_span_size) do { } while (0)
+
+#endif
+
+#endif /* TRACE_H */
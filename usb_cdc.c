@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stm32f1xx.h>
 #include "system_interrupts.h"
+#include "system_time.h"
 #include "circ_buf.h"
 #include "usb_std.h"
 #include "usb_core.h"
@@ -15,6 +16,9 @@
 #include "cdc_shell.h"
 #include "device_config.h"
 #include "gpio.h"
+#include "trace.h"
+#include "perf.h"
+#include "event_trace.h"
 #include "usb_cdc.h"
 
 /* USB CDC Device Enabled Flag */
@@ -32,26 +36,290 @@ static const usb_cdc_line_coding_t usb_cdc_default_line_coding = {
 };
 
 typedef struct {
-    circ_buf_t              rx_buf;
-    uint8_t                 _rx_data[USB_CDC_BUF_SIZE];
-    circ_buf_t              tx_buf;
-    uint8_t                 _tx_data[USB_CDC_BUF_SIZE];
+    uint32_t                tx_pos; /* tx_bytes when the barrier is reached */
+    usb_cdc_line_coding_t   line_coding; /* As requested by the host */
+} usb_cdc_line_coding_barrier_t;
+
+typedef struct {
+    circ_buf_t              *rx_buf;
+    size_t                  rx_buf_size;
+    circ_buf_t              *tx_buf;
+    size_t                  tx_buf_size;
     usb_cdc_line_coding_t   line_coding;
+    uint32_t                line_coding_rate; /* Requested, line_coding has the actual rate */
     uint8_t                 usb_rx_pending_ep;
     size_t                  last_dma_tx_size;
-    uint8_t                 rx_zlp_pending;
-    uint8_t                 line_state_change_pending;
-    uint8_t                 line_state_change_ready;
+    size_t                  rx_usb_transfer_size; /* Not yet taken from the RX queue */
+    size_t                  rx_usb_transfer_sent; /* Taken from the RX queue */
+    uint8_t                 rx_usb_zlp_pending;
+    uint8_t                 rx_latency_timer;
+    volatile uint8_t        rx_flush_pending;
+    usb_cdc_line_coding_barrier_t line_coding_barriers[USB_CDC_LINE_CODING_BARRIERS];
+    uint8_t                 line_coding_barriers_first;
+    uint8_t                 line_coding_barriers_count;
+    volatile uint8_t        line_coding_barrier_reached;
+    volatile uint8_t        line_state_change_ready;
     usb_cdc_serial_state_t  serial_state;
     usb_cdc_serial_state_t  serial_state_prev;
     uint8_t                 rts_active;
+    uint8_t                 rts_pin_active;
     uint8_t                 dtr_active;
     uint8_t                 txa_active;
     volatile uint32_t       *txa_bitband_clear;
+    uint32_t                rx_overruns;
+    uint32_t                rx_bytes;
+    uint32_t                tx_bytes;
+    uint32_t                rx_bytes_prev;
+    uint32_t                tx_bytes_prev;
+    uint32_t                rx_rate;
+    uint32_t                tx_rate;
+    uint32_t                parity_errors;
+    uint32_t                framing_errors;
+    uint32_t                noise_errors;
+    uint32_t                usb_out_naks;
+    size_t                  rx_peak;
+    size_t                  tx_peak;
+#if USB_CDC_RX_CAPTURE
+    uint8_t                 rx_capture;
+    volatile uint8_t        rx_capture_boundary;
+    volatile uint32_t       rx_capture_boundary_time;
+    uint32_t                rx_capture_out;
+    uint32_t                rx_capture_marked;
+    uint8_t                 rx_capture_mark_head;
+    uint8_t                 rx_capture_marks;
+    struct {
+        uint32_t            end;
+        uint32_t            time;
+    }                       rx_capture_mark[USB_CDC_RX_CAPTURE_MARKS];
+    uint8_t                 rx_capture_buf[USB_CDC_RX_CAPTURE_BUF_SIZE] __attribute__ ((aligned(4)));
+#endif
+    uint32_t                rx_error_pos;
+    uint8_t                 rx_error_pos_valid;
+    uint8_t                 rx_error_flags; /* Already recorded for rx_error_pos */
+#if USB_CDC_RX_ERROR_MARKS
+    uint8_t                 rx_error_marks;
+    volatile uint32_t       rx_error_head;
+    uint32_t                rx_error_tail;
+    struct {
+        uint32_t            pos;
+        uint32_t            flags;
+    }                       rx_error[USB_CDC_RX_ERROR_MARKS_DEPTH];
+    uint8_t                 rx_error_marks_buf[USB_CDC_RX_ERROR_MARKS_BUF_SIZE];
+#endif
+#if USB_CDC_BUF_POOL
+    uint8_t                 rx_block_head;
+    uint8_t                 rx_block_tail;
+    uint8_t                 rx_blocks;
+    uint8_t                 rx_blocks_reserved;
+    uint8_t                 rx_blocks_peak;
+    volatile uint8_t        rx_dma_stalled;
+    size_t                  rx_block_offset;
+    size_t                  rx_block_fill;
+    uint32_t                rx_dma_written;
+#else
+    volatile uint32_t       rx_dma_halves;
+    uint32_t                rx_dma_written;
+    uint32_t                rx_lost_bytes;
+#endif
 } usb_cdc_state_t;
 
 static usb_cdc_state_t usb_cdc_states[USB_CDC_NUM_PORTS];
 
+/*
+ * USB CDC Buffer Arena
+ *
+ * Port RX and TX buffers are carved from a single arena at boot and on USB reset,
+ * each buffer is a circ_buf_t header followed by a power of two data area.
+ * The sizes configured at boot are used until restart, invalid configured sizes
+ * fall back to USB_CDC_BUF_SIZE for all buffers.
+ * With USB_CDC_BUF_POOL, RX buffers are replaced by the buffer pool.
+ */
+
+static uint8_t usb_cdc_buf_arena[USB_CDC_BUF_ARENA_SIZE +
+                                 USB_CDC_NUM_PORTS * 2 * sizeof(circ_buf_t)] __attribute__ ((aligned(4)));
+
+#if USB_CDC_BUF_POOL
+
+/*
+ * USB CDC Buffer Pool
+ *
+ * The arena space left after the TX buffers is split into blocks lent to
+ * the port RX queues. Each port has its configured RX buffer size reserved,
+ * the rest of the blocks go to whichever port needs them. When fewer than
+ * a fair share of unreserved blocks is left, only ports that borrowed less
+ * than a fair share get more. The pool is accessed with interrupts disabled,
+ * blocks are taken in the RX DMA interrupt handlers.
+ */
+
+#define USB_CDC_POOL_MAX_BLOCKS         (sizeof(usb_cdc_buf_arena) / USB_CDC_POOL_BLOCK_SIZE)
+#define USB_CDC_POOL_BLOCK_NONE         0xff
+#define USB_CDC_POOL_RTS_BLOCKS         ((USB_CDC_BUF_SIZE >> 1) / USB_CDC_POOL_BLOCK_SIZE)
+
+static struct {
+    uint8_t *data;
+    uint8_t next[USB_CDC_POOL_MAX_BLOCKS];
+    uint8_t free_head;
+    uint8_t free_count;
+    uint8_t fair_share;
+} usb_cdc_pool;
+
+static uint32_t usb_cdc_pool_lock() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static void usb_cdc_pool_unlock(uint32_t primask) {
+    __set_PRIMASK(primask);
+}
+
+static uint8_t *usb_cdc_pool_block_data(uint8_t block) {
+    return &usb_cdc_pool.data[block * USB_CDC_POOL_BLOCK_SIZE];
+}
+
+static void usb_cdc_pool_init(uint8_t *data, size_t size, const size_t *rx_buf_sizes) {
+    size_t num_blocks = size / USB_CDC_POOL_BLOCK_SIZE;
+    size_t reserved_blocks = 0;
+    usb_cdc_pool.data = data;
+    usb_cdc_pool.free_head = USB_CDC_POOL_BLOCK_NONE;
+    usb_cdc_pool.free_count = 0;
+    for (int block = num_blocks - 1; block >= 0; block--) {
+        usb_cdc_pool.next[block] = usb_cdc_pool.free_head;
+        usb_cdc_pool.free_head = block;
+        usb_cdc_pool.free_count++;
+    }
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+        cdc_state->rx_block_head = cdc_state->rx_block_tail = USB_CDC_POOL_BLOCK_NONE;
+        cdc_state->rx_blocks = 0;
+        cdc_state->rx_blocks_reserved = rx_buf_sizes[port] / USB_CDC_POOL_BLOCK_SIZE;
+        reserved_blocks += cdc_state->rx_blocks_reserved;
+    }
+    usb_cdc_pool.fair_share = (num_blocks - reserved_blocks) / USB_CDC_NUM_PORTS;
+}
+
+/* Blocks still reserved for the other ports */
+static size_t usb_cdc_pool_reserved_blocks(int port) {
+    size_t reserved_blocks = 0;
+    for (int other_port = 0; other_port < USB_CDC_NUM_PORTS; other_port++) {
+        const usb_cdc_state_t *cdc_state = &usb_cdc_states[other_port];
+        if ((other_port != port) && (cdc_state->rx_blocks < cdc_state->rx_blocks_reserved)) {
+            reserved_blocks += cdc_state->rx_blocks_reserved - cdc_state->rx_blocks;
+        }
+    }
+    return reserved_blocks;
+}
+
+static int usb_cdc_pool_can_take(int port) {
+    const usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    size_t reserved_blocks = usb_cdc_pool_reserved_blocks(port);
+    if (cdc_state->rx_blocks < cdc_state->rx_blocks_reserved) {
+        return (usb_cdc_pool.free_count != 0);
+    }
+    if (usb_cdc_pool.free_count <= reserved_blocks) {
+        return 0;
+    }
+    if ((usb_cdc_pool.free_count - reserved_blocks) <= usb_cdc_pool.fair_share) {
+        return ((cdc_state->rx_blocks - cdc_state->rx_blocks_reserved) < usb_cdc_pool.fair_share);
+    }
+    return 1;
+}
+
+/* NOTE: The pool must be locked */
+static int usb_cdc_pool_append_block(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint8_t block;
+    if (!usb_cdc_pool_can_take(port)) {
+        return 0;
+    }
+    block = usb_cdc_pool.free_head;
+    usb_cdc_pool.free_head = usb_cdc_pool.next[block];
+    usb_cdc_pool.free_count--;
+    usb_cdc_pool.next[block] = USB_CDC_POOL_BLOCK_NONE;
+    if (cdc_state->rx_block_tail != USB_CDC_POOL_BLOCK_NONE) {
+        usb_cdc_pool.next[cdc_state->rx_block_tail] = block;
+    } else {
+        cdc_state->rx_block_head = block;
+        cdc_state->rx_block_offset = 0;
+    }
+    cdc_state->rx_block_tail = block;
+    cdc_state->rx_block_fill = 0;
+    if (++cdc_state->rx_blocks > cdc_state->rx_blocks_peak) {
+        cdc_state->rx_blocks_peak = cdc_state->rx_blocks;
+    }
+    return 1;
+}
+
+/* NOTE: The pool must be locked */
+static void usb_cdc_pool_release_block(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint8_t block = cdc_state->rx_block_head;
+    cdc_state->rx_block_head = usb_cdc_pool.next[block];
+    if (cdc_state->rx_block_head == USB_CDC_POOL_BLOCK_NONE) {
+        cdc_state->rx_block_tail = USB_CDC_POOL_BLOCK_NONE;
+    }
+    usb_cdc_pool.next[block] = usb_cdc_pool.free_head;
+    usb_cdc_pool.free_head = block;
+    usb_cdc_pool.free_count++;
+    cdc_state->rx_blocks--;
+    cdc_state->rx_block_offset = 0;
+}
+
+#endif /* USB_CDC_BUF_POOL */
+
+int usb_cdc_buf_sizes_valid(const size_t *rx_buf_sizes, const size_t *tx_buf_sizes) {
+    size_t total_size = 0;
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        size_t rx_buf_size = rx_buf_sizes[port];
+        size_t tx_buf_size = tx_buf_sizes[port];
+        size_t rx_buf_size_min = (port == USB_CDC_CONFIG_PORT) ? USB_CDC_CONFIG_PORT_BUF_SIZE_MIN : USB_CDC_BUF_SIZE_MIN;
+        if ((rx_buf_size < rx_buf_size_min) || (rx_buf_size & (rx_buf_size - 1)) ||
+            (tx_buf_size < USB_CDC_BUF_SIZE_MIN) || (tx_buf_size & (tx_buf_size - 1))) {
+            return 0;
+        }
+        total_size += rx_buf_size + tx_buf_size;
+    }
+    return (total_size <= USB_CDC_BUF_ARENA_SIZE);
+}
+
+/* Buffer sizes are taken from the configuration once, at boot */
+static size_t usb_cdc_rx_buf_sizes[USB_CDC_NUM_PORTS];
+static size_t usb_cdc_tx_buf_sizes[USB_CDC_NUM_PORTS];
+
+static void usb_cdc_init_buf_sizes() {
+    const cdc_port_t *port_configs = device_config_get()->cdc_config.port_config;
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        usb_cdc_rx_buf_sizes[port] = port_configs[port].rx_buf_size;
+        usb_cdc_tx_buf_sizes[port] = port_configs[port].tx_buf_size;
+    }
+    if (!usb_cdc_buf_sizes_valid(usb_cdc_rx_buf_sizes, usb_cdc_tx_buf_sizes)) {
+        for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+            usb_cdc_rx_buf_sizes[port] = USB_CDC_BUF_SIZE;
+            usb_cdc_tx_buf_sizes[port] = USB_CDC_BUF_SIZE;
+        }
+    }
+}
+
+static void usb_cdc_alloc_buffers() {
+    uint8_t *arena_ptr = usb_cdc_buf_arena;
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+#if !USB_CDC_BUF_POOL
+        cdc_state->rx_buf = (circ_buf_t*)arena_ptr;
+        cdc_state->rx_buf_size = usb_cdc_rx_buf_sizes[port];
+        arena_ptr += sizeof(circ_buf_t) + usb_cdc_rx_buf_sizes[port];
+        cdc_state->rx_buf->head = cdc_state->rx_buf->tail = 0;
+#endif
+        cdc_state->tx_buf = (circ_buf_t*)arena_ptr;
+        cdc_state->tx_buf_size = usb_cdc_tx_buf_sizes[port];
+        arena_ptr += sizeof(circ_buf_t) + usb_cdc_tx_buf_sizes[port];
+        cdc_state->tx_buf->head = cdc_state->tx_buf->tail = 0;
+    }
+#if USB_CDC_BUF_POOL
+    usb_cdc_pool_init(arena_ptr, usb_cdc_buf_arena + sizeof(usb_cdc_buf_arena) - arena_ptr, usb_cdc_rx_buf_sizes);
+#endif
+}
+
 /* Helper Functions */
 
 static USART_TypeDef* const usb_cdc_port_usarts[] = {
@@ -97,9 +365,22 @@ static uint8_t usb_cdc_get_port_data_ep(int port) {
     return -1;
 }
 
+static uint8_t const usb_cdc_port_data_out_endpoints[] = {
+    usb_endpoint_address_cdc_0_data_out,
+    usb_endpoint_address_cdc_1_data_out,
+    usb_endpoint_address_cdc_2_data_out,
+};
+
+static uint8_t usb_cdc_get_port_data_out_ep(int port) {
+    if (port < (sizeof(usb_cdc_port_data_out_endpoints) / sizeof(*usb_cdc_port_data_out_endpoints))) {
+        return usb_cdc_port_data_out_endpoints[port];
+    }
+    return -1;
+}
+
 static int usb_cdc_data_endpoint_port(uint8_t ep_num) {
-    for (int port = 0; port < (sizeof(usb_cdc_port_data_endpoints) / sizeof(*usb_cdc_port_data_endpoints)); port++) {
-        if (usb_cdc_port_data_endpoints[port] == ep_num) {
+    for (int port = 0; port < (sizeof(usb_cdc_port_data_out_endpoints) / sizeof(*usb_cdc_port_data_out_endpoints)); port++) {
+        if (usb_cdc_port_data_out_endpoints[port] == ep_num) {
             return port;
         }
     }
@@ -139,6 +420,11 @@ static int usb_cdc_get_interface_port(uint8_t if_num) {
     return -1;
 }
 
+/* Atomic access to a single USART register bit, the USART interrupt may preempt read-modify-write */
+static volatile uint32_t *usb_cdc_get_usart_bitband_addr(volatile uint32_t *reg, uint32_t bit_pos) {
+    return (volatile uint32_t *)(PERIPH_BB_BASE + (((uint32_t)reg - PERIPH_BASE) << 5) + (bit_pos << 2));
+}
+
 static uint32_t usb_cdc_get_port_fck(int port) {
     if (port == 0) {
         return SystemCoreClock;
@@ -146,6 +432,286 @@ static uint32_t usb_cdc_get_port_fck(int port) {
     return SystemCoreClock >> 1;
 }
 
+/*
+ * With 16x oversampling, BRR holds fck / baud rate as a 12.4 fixed point
+ * number, the minimum value 16 gives the maximum rate of fck / 16.
+ * Returns 0 if the rate error exceeds the tolerance.
+ */
+static uint32_t usb_cdc_get_port_brr(int port, uint32_t baud_rate) {
+    uint32_t fck = usb_cdc_get_port_fck(port);
+    uint32_t brr = (fck + (baud_rate >> 1)) / baud_rate;
+    uint32_t actual_baud_rate;
+    uint32_t baud_rate_error;
+    if (brr < 0x10) {
+        brr = 0x10;
+    } else if (brr > (USART_BRR_DIV_Mantissa | USART_BRR_DIV_Fraction)) {
+        brr = (USART_BRR_DIV_Mantissa | USART_BRR_DIV_Fraction);
+    }
+    actual_baud_rate = (fck + (brr >> 1)) / brr;
+    baud_rate_error = (actual_baud_rate > baud_rate) ? (actual_baud_rate - baud_rate) : (baud_rate - actual_baud_rate);
+    if ((uint64_t)baud_rate_error * 1000 > (uint64_t)baud_rate * USB_CDC_BAUD_RATE_TOLERANCE) {
+        return 0;
+    }
+    return brr;
+}
+
+/*
+ * USB CDC RX Queue
+ *
+ * Received UART data is queued in the port RX ring buffer, or in a list of
+ * pool blocks with USB_CDC_BUF_POOL. The data is taken from the queue in up
+ * to two contiguous spans.
+ */
+
+/* The transfer to the host stops reading the queue, the packets already queued are still sent */
+static void usb_cdc_port_rx_usb_stop(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    if (cdc_state->rx_usb_transfer_size) {
+        usb_transfer_stop(usb_cdc_get_port_data_ep(port));
+        cdc_state->rx_usb_transfer_size = 0;
+    }
+}
+
+#if USB_CDC_BUF_POOL
+
+/* NOTE: The pool must be locked */
+static size_t usb_cdc_port_rx_tail_fill(int port) {
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    if (dma_rx_ch->CCR & DMA_CCR_EN) {
+        return USB_CDC_POOL_BLOCK_SIZE - dma_rx_ch->CNDTR;
+    }
+    return usb_cdc_states[port].rx_block_fill;
+}
+
+/* Returns the number of bytes written by the RX DMA since the reset */
+static uint32_t usb_cdc_port_rx_dma_written(int port) {
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    uint32_t primask = usb_cdc_pool_lock();
+    uint32_t rx_dma_written = usb_cdc_states[port].rx_dma_written;
+    if (dma_rx_ch->CCR & DMA_CCR_EN) {
+        rx_dma_written += USB_CDC_POOL_BLOCK_SIZE - dma_rx_ch->CNDTR;
+    }
+    usb_cdc_pool_unlock(primask);
+    return rx_dma_written;
+}
+
+static void usb_cdc_port_rx_arm_dma(int port) {
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    dma_rx_ch->CMAR = (uint32_t)usb_cdc_pool_block_data(usb_cdc_states[port].rx_block_tail);
+    dma_rx_ch->CNDTR = USB_CDC_POOL_BLOCK_SIZE;
+    dma_rx_ch->CCR |= DMA_CCR_EN;
+}
+
+static size_t usb_cdc_port_rx_count(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    size_t count = 0;
+    uint32_t primask = usb_cdc_pool_lock();
+    if (cdc_state->rx_blocks) {
+        count = (cdc_state->rx_blocks - 1) * USB_CDC_POOL_BLOCK_SIZE +
+                usb_cdc_port_rx_tail_fill(port) - cdc_state->rx_block_offset;
+    }
+    usb_cdc_pool_unlock(primask);
+    return count;
+}
+
+static size_t usb_cdc_port_rx_peek(int port, size_t count, uint8_t **span, size_t *span_size, uint8_t **wrap_span) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    size_t wrap_span_size = 0;
+    uint32_t primask = usb_cdc_pool_lock();
+    uint8_t block = cdc_state->rx_block_head;
+    size_t block_size = (block == cdc_state->rx_block_tail) ? usb_cdc_port_rx_tail_fill(port) : USB_CDC_POOL_BLOCK_SIZE;
+    *span = usb_cdc_pool_block_data(block) + cdc_state->rx_block_offset;
+    *span_size = block_size - cdc_state->rx_block_offset;
+    *wrap_span = *span;
+    if (*span_size > count) {
+        *span_size = count;
+    } else if ((*span_size < count) && (block != cdc_state->rx_block_tail)) {
+        block = usb_cdc_pool.next[block];
+        block_size = (block == cdc_state->rx_block_tail) ? usb_cdc_port_rx_tail_fill(port) : USB_CDC_POOL_BLOCK_SIZE;
+        *wrap_span = usb_cdc_pool_block_data(block);
+        wrap_span_size = count - *span_size;
+        if (wrap_span_size > block_size) {
+            wrap_span_size = block_size;
+        }
+    }
+    usb_cdc_pool_unlock(primask);
+    return *span_size + wrap_span_size;
+}
+
+static void usb_cdc_port_rx_consume(int port, size_t count) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint32_t primask = usb_cdc_pool_lock();
+    cdc_state->rx_block_offset += count;
+    while ((cdc_state->rx_block_head != USB_CDC_POOL_BLOCK_NONE) &&
+           (cdc_state->rx_block_offset >= USB_CDC_POOL_BLOCK_SIZE)) {
+        size_t rx_block_offset = cdc_state->rx_block_offset - USB_CDC_POOL_BLOCK_SIZE;
+        usb_cdc_pool_release_block(port);
+        cdc_state->rx_block_offset = rx_block_offset;
+    }
+    /* Resume reception stopped for the lack of blocks on any port */
+    for (int stalled_port = 0; stalled_port < USB_CDC_NUM_PORTS; stalled_port++) {
+        usb_cdc_state_t *stalled_cdc_state = &usb_cdc_states[stalled_port];
+        if (stalled_cdc_state->rx_dma_stalled && usb_cdc_pool_append_block(stalled_port)) {
+            stalled_cdc_state->rx_dma_stalled = 0;
+            usb_cdc_port_rx_arm_dma(stalled_port);
+        }
+    }
+    usb_cdc_pool_unlock(primask);
+}
+
+static int usb_cdc_port_rx_space_low(int port) {
+    const usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    int space_low;
+    uint32_t primask = usb_cdc_pool_lock();
+    size_t reserved_blocks = usb_cdc_pool_reserved_blocks(port);
+    size_t own_reserved_blocks = (cdc_state->rx_blocks < cdc_state->rx_blocks_reserved) ?
+                                 (cdc_state->rx_blocks_reserved - cdc_state->rx_blocks) : 0;
+    space_low = (usb_cdc_pool.free_count < reserved_blocks + USB_CDC_POOL_RTS_BLOCKS) &&
+                (own_reserved_blocks < USB_CDC_POOL_RTS_BLOCKS);
+    usb_cdc_pool_unlock(primask);
+    return space_low;
+}
+
+/* Drops queued data, stops the RX DMA, and returns all blocks to the pool */
+static void usb_cdc_port_rx_clear(int port) {
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint32_t primask = usb_cdc_pool_lock();
+    dma_rx_ch->CCR &= ~(DMA_CCR_EN);
+    while (cdc_state->rx_block_head != USB_CDC_POOL_BLOCK_NONE) {
+        usb_cdc_pool_release_block(port);
+    }
+    cdc_state->rx_dma_stalled = 0;
+    usb_cdc_port_rx_usb_stop(port);
+#if USB_CDC_RX_CAPTURE
+    cdc_state->rx_capture = 0; /* Restarted by the next poll */
+#endif
+    usb_cdc_pool_unlock(primask);
+}
+
+/* NOTE: Data that do not fit in the pool are dropped */
+static void usb_cdc_port_rx_write(int port, const void *buf, size_t count) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    while (count) {
+        size_t bytes_to_copy;
+        if ((cdc_state->rx_block_tail == USB_CDC_POOL_BLOCK_NONE) ||
+            (cdc_state->rx_block_fill == USB_CDC_POOL_BLOCK_SIZE)) {
+            uint32_t primask = usb_cdc_pool_lock();
+            int block_appended = usb_cdc_pool_append_block(port);
+            usb_cdc_pool_unlock(primask);
+            if (!block_appended) {
+                return;
+            }
+        }
+        bytes_to_copy = USB_CDC_POOL_BLOCK_SIZE - cdc_state->rx_block_fill;
+        if (bytes_to_copy > count) {
+            bytes_to_copy = count;
+        }
+        memcpy(usb_cdc_pool_block_data(cdc_state->rx_block_tail) + cdc_state->rx_block_fill, buf, bytes_to_copy);
+        cdc_state->rx_block_fill += bytes_to_copy;
+        count -= bytes_to_copy;
+        buf = (uint8_t*)buf + bytes_to_copy;
+    }
+}
+
+#else
+
+static size_t usb_cdc_port_rx_count(int port) {
+    const circ_buf_t *rx_buf = usb_cdc_states[port].rx_buf;
+    return circ_buf_count(rx_buf->head, rx_buf->tail, usb_cdc_states[port].rx_buf_size);
+}
+
+static size_t usb_cdc_port_rx_peek(int port, size_t count, uint8_t **span, size_t *span_size, uint8_t **wrap_span) {
+    circ_buf_t *rx_buf = usb_cdc_states[port].rx_buf;
+    *span = &rx_buf->data[rx_buf->tail];
+    *span_size = circ_buf_count_to_end(rx_buf->head, rx_buf->tail, usb_cdc_states[port].rx_buf_size);
+    *wrap_span = rx_buf->data;
+    if (*span_size > count) {
+        *span_size = count;
+    }
+    return count;
+}
+
+static void usb_cdc_port_rx_consume(int port, size_t count) {
+    circ_buf_t *rx_buf = usb_cdc_states[port].rx_buf;
+    rx_buf->tail = (rx_buf->tail + count) & (usb_cdc_states[port].rx_buf_size - 1);
+}
+
+static int usb_cdc_port_rx_space_low(int port) {
+    const circ_buf_t *rx_buf = usb_cdc_states[port].rx_buf;
+    size_t rx_buf_size = usb_cdc_states[port].rx_buf_size;
+    return !(circ_buf_space(rx_buf->head, rx_buf->tail, rx_buf_size) > (rx_buf_size>>1));
+}
+
+static uint32_t usb_cdc_get_port_rx_dma_flags(int port) {
+    static const uint32_t port_rx_dma_flags[] = {
+        DMA_IFCR_CGIF5,
+        DMA_IFCR_CGIF6,
+        DMA_IFCR_CGIF3,
+    };
+    return port_rx_dma_flags[port];
+}
+
+/* Called by the RX DMA interrupt at each half of the RX buffer */
+static void usb_cdc_port_rx_dma_half_complete(int port, uint32_t halves) {
+    usb_cdc_states[port].rx_dma_halves += halves;
+}
+
+/*
+ * Returns the number of bytes written by the RX DMA since the start, exact as
+ * long as the RX DMA interrupt is served within half of the RX buffer time.
+ */
+static uint32_t usb_cdc_port_rx_dma_written(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    size_t rx_buf_size = cdc_state->rx_buf_size;
+    size_t rx_buf_half = rx_buf_size >> 1;
+    uint32_t halves;
+    size_t dma_head;
+    do {
+        halves = cdc_state->rx_dma_halves;
+        dma_head = (rx_buf_size - dma_rx_ch->CNDTR) & (rx_buf_size - 1);
+    } while (halves != cdc_state->rx_dma_halves);
+    /* The DMA has crossed a half, the interrupt is pending */
+    if ((dma_head >= rx_buf_half) != (halves & 1)) {
+        halves++;
+    }
+    return (halves & ~1) * rx_buf_half + dma_head;
+}
+
+/* Drops queued data, the RX DMA keeps running */
+static void usb_cdc_port_rx_clear(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    cdc_state->rx_dma_written = usb_cdc_port_rx_dma_written(port);
+    cdc_state->rx_buf->tail = cdc_state->rx_buf->head = cdc_state->rx_dma_written & (cdc_state->rx_buf_size - 1);
+    usb_cdc_port_rx_usb_stop(port);
+#if USB_CDC_RX_CAPTURE
+    cdc_state->rx_capture = 0; /* Restarted by the next poll */
+#endif
+}
+
+/* NOTE: The oldest data are overwritten if the buffer is full */
+static void usb_cdc_port_rx_write(int port, const void *buf, size_t count) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    circ_buf_t *rx_buf = cdc_state->rx_buf;
+    size_t rx_buf_size = cdc_state->rx_buf_size;
+    while (count) {
+        size_t bytes_to_copy;
+        size_t space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, rx_buf_size);
+        if (space_available == 0) {
+            rx_buf->tail = rx_buf->head;
+            space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, rx_buf_size);
+        }
+        bytes_to_copy = (space_available > count) ? count : space_available;
+        memcpy(&rx_buf->data[rx_buf->head], buf, bytes_to_copy);
+        rx_buf->head = (rx_buf->head + bytes_to_copy) & (rx_buf_size - 1);
+        count -= bytes_to_copy;
+        buf = (uint8_t*)buf + bytes_to_copy;
+    }
+}
+
+#endif /* USB_CDC_BUF_POOL */
+
 /* USB CDC Notifications */
 
 static int usb_cdc_send_port_state(int port, usb_cdc_serial_state_t state) {
@@ -174,7 +740,9 @@ static void usb_cdc_notify_port_state_change(int port) {
     usb_cdc_serial_state_t state = usb_cdc_states[port].serial_state;
     if (state != usb_cdc_states[port].serial_state_prev) {
         if (usb_cdc_send_port_state(port, state) != -1) {
-            usb_cdc_serial_state_t mask = (state & (USB_CDC_SERIAL_STATE_OVERRUN | USB_CDC_SERIAL_STATE_PARITY_ERROR));
+            trace_record(trace_record_serial_state, port, &state, sizeof(state));
+            usb_cdc_serial_state_t mask = (state & (USB_CDC_SERIAL_STATE_OVERRUN | USB_CDC_SERIAL_STATE_PARITY_ERROR |
+                                                    USB_CDC_SERIAL_STATE_FRAMING_ERROR | USB_CDC_SERIAL_STATE_BREAK));
             usb_cdc_serial_state_t _state;
             do {
                 _state = usb_cdc_states[port].serial_state;
@@ -186,11 +754,76 @@ static void usb_cdc_notify_port_state_change(int port) {
 
 static void usb_cdc_notify_port_overrun(int port) {
     usb_cdc_serial_state_t _state;
+    __sync_fetch_and_add(&usb_cdc_states[port].rx_overruns, 1);
     do {
         _state = usb_cdc_states[port].serial_state;
     } while (!(__sync_bool_compare_and_swap(&usb_cdc_states[port].serial_state, _state, (_state | USB_CDC_SERIAL_STATE_OVERRUN))));
 }
 
+/*
+ * USART RX Errors
+ *
+ * The USART raises the error flags with RXNE of the bad byte, and they are
+ * cleared by reading SR and then DR, no matter whether DR is read by the RX DMA.
+ * The USART interrupt records the error without waiting for the RX DMA, so it
+ * may run again for the same byte until the RX DMA has read it. An overrun
+ * raised while the byte is still waiting for the RX DMA is recorded at its position too.
+ */
+
+static void usb_cdc_port_rx_errors_clear(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    cdc_state->rx_error_pos_valid = 0;
+#if USB_CDC_RX_ERROR_MARKS
+    cdc_state->rx_error_tail = cdc_state->rx_error_head;
+#endif
+}
+
+/* Called by the USART interrupt */
+static void usb_cdc_port_rx_error(int port, USART_TypeDef *usart, uint32_t status) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint32_t rx_pos = usb_cdc_port_rx_dma_written(port);
+    if (!(status & USART_SR_RXNE)) {
+        rx_pos--;
+    } else if (!(usart->SR & USART_SR_RXNE)) {
+        /* The RX DMA has just read the byte */
+        rx_pos = usb_cdc_port_rx_dma_written(port) - 1;
+    }
+    status &= (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE);
+    if (cdc_state->rx_error_pos_valid && (cdc_state->rx_error_pos == rx_pos)) {
+        status &= ~(cdc_state->rx_error_flags);
+        if (!status) {
+            return;
+        }
+        cdc_state->rx_error_flags |= status;
+    } else {
+        cdc_state->rx_error_pos = rx_pos;
+        cdc_state->rx_error_pos_valid = 1;
+        cdc_state->rx_error_flags = status;
+    }
+    if (status & USART_SR_ORE) {
+        usb_cdc_notify_port_overrun(port);
+    }
+    if (status & USART_SR_PE) {
+        cdc_state->serial_state |= USB_CDC_SERIAL_STATE_PARITY_ERROR;
+        cdc_state->parity_errors++;
+    }
+    if (status & USART_SR_FE) {
+        cdc_state->serial_state |= USB_CDC_SERIAL_STATE_FRAMING_ERROR;
+        cdc_state->framing_errors++;
+    }
+    if (status & USART_SR_NE) {
+        cdc_state->noise_errors++;
+    }
+#if USB_CDC_RX_ERROR_MARKS
+    if (status & (USART_SR_PE | USART_SR_FE)) {
+        uint32_t rx_error_head = cdc_state->rx_error_head;
+        cdc_state->rx_error[rx_error_head & (USB_CDC_RX_ERROR_MARKS_DEPTH - 1)].pos = rx_pos;
+        cdc_state->rx_error[rx_error_head & (USB_CDC_RX_ERROR_MARKS_DEPTH - 1)].flags = status & (USART_SR_PE | USART_SR_FE);
+        cdc_state->rx_error_head = rx_error_head + 1;
+    }
+#endif
+}
+
 /* Line State and Coding */
 
 static void usb_cdc_update_port_dtr(int port) {
@@ -213,8 +846,11 @@ static void usb_cdc_update_port_rts(int port) {
     if ((port < USB_CDC_NUM_PORTS)) {
         const gpio_pin_t *rts_pin = &device_config_get()->cdc_config.port_config[port].pins[cdc_pin_rts];
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-        circ_buf_t *rx_buf = &cdc_state->rx_buf;
-        int rts_active = ((circ_buf_space(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE) > (USB_CDC_BUF_SIZE>>1))) && cdc_state->rts_active;
+        int rts_active = !usb_cdc_port_rx_space_low(port) && cdc_state->rts_active;
+        if (rts_active != cdc_state->rts_pin_active) {
+            cdc_state->rts_pin_active = rts_active;
+            event_trace_write(event_trace_rts, port, rts_active);
+        }
         gpio_pin_set(rts_pin, rts_active);
     }
 }
@@ -242,6 +878,7 @@ static void usb_cdc_set_port_txa(int port, int txa_active) {
 }
 
 static usb_status_t usb_cdc_set_control_line_state(int port, uint16_t state) {
+    trace_record(trace_record_control_lines, port, &state, sizeof(state));
     usb_cdc_set_port_dtr(port, (state & USB_CDC_CONTROL_LINE_STATE_DTR_MASK));
     usb_cdc_set_port_rts(port, (state & USB_CDC_CONTROL_LINE_STATE_RTS_MASK));
     return usb_status_ack;
@@ -250,11 +887,15 @@ static usb_status_t usb_cdc_set_control_line_state(int port, uint16_t state) {
 static usb_status_t usb_cdc_set_line_coding(int port, const usb_cdc_line_coding_t *line_coding, int dry_run) {
     USART_TypeDef *usart = usb_cdc_get_port_usart(port);
     if (line_coding->dwDTERate != 0) {
-        uint32_t new_brr = usb_cdc_get_port_fck(port) / line_coding->dwDTERate;
+        uint32_t new_brr = usb_cdc_get_port_brr(port, line_coding->dwDTERate);
+        if (new_brr == 0) {
+            return usb_status_fail;
+        }
         if (!dry_run) {
             usart->BRR = new_brr;
         }
-        usb_cdc_states[port].line_coding.dwDTERate = line_coding->dwDTERate;
+        usb_cdc_states[port].line_coding_rate = line_coding->dwDTERate;
+        usb_cdc_states[port].line_coding.dwDTERate = (usb_cdc_get_port_fck(port) + (new_brr >> 1)) / new_brr;
     }
     if (line_coding->bCharFormat < usb_cdc_char_format_last) {
         uint32_t new_char_format = 0;
@@ -309,63 +950,533 @@ static usb_status_t usb_cdc_set_line_coding(int port, const usb_cdc_line_coding_
     } else {
         return usb_status_fail;
     }
+    event_trace_write(dry_run ? event_trace_line_coding_pending : event_trace_line_coding_set,
+                      port, usb_cdc_states[port].line_coding.dwDTERate / 100);
     if (!dry_run) {
+        trace_record(trace_record_line_coding, port, &usb_cdc_states[port].line_coding, sizeof(usb_cdc_line_coding_t));
         /* force sending port state, this helps some apps */
         usb_cdc_states[port].serial_state_prev = ~(usb_cdc_states[port].serial_state_prev & 0);
     }
     return usb_status_ack;
 }
 
+/* USB USART RX Capture */
+
+#if USB_CDC_RX_CAPTURE
+
+/*
+ * Received bytes are counted from the start of the capture, a mark ends
+ * a record at a byte count. Marks are made by the poll function from
+ * the boundaries latched by the interrupts, so the bytes received between
+ * the interrupt and the poll go to the record ending at the boundary.
+ */
+
+static uint8_t usb_cdc_rx_capture_ports = 0;
+
+void usb_cdc_set_port_rx_capture(int port, int enabled) {
+    if (port < USB_CDC_NUM_PORTS) {
+        if (enabled) {
+            __sync_fetch_and_or(&usb_cdc_rx_capture_ports, 1 << port);
+        } else {
+            __sync_fetch_and_and(&usb_cdc_rx_capture_ports, ~(1 << port));
+        }
+    }
+}
+
+int usb_cdc_get_port_rx_capture(int port) {
+    return (port < USB_CDC_NUM_PORTS) && (usb_cdc_rx_capture_ports & (1 << port));
+}
+
+static int usb_cdc_port_rx_capture_active(int port) {
+    return usb_cdc_get_port_rx_capture(port) && ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode);
+}
+
+/* Called by the USART and RX DMA interrupts */
+static void usb_cdc_port_rx_capture_boundary(int port) {
+    usb_cdc_states[port].rx_capture_boundary_time = system_time_now();
+    usb_cdc_states[port].rx_capture_boundary = 1;
+}
+
+static void usb_cdc_port_rx_capture_mark(int port, uint32_t end, uint32_t time) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    if (end != cdc_state->rx_capture_marked) {
+        uint8_t mark = cdc_state->rx_capture_mark_head + cdc_state->rx_capture_marks;
+        if (cdc_state->rx_capture_marks < USB_CDC_RX_CAPTURE_MARKS) {
+            cdc_state->rx_capture_marks++;
+        } else {
+            /* Out of marks, extend the last record */
+            mark--;
+        }
+        mark &= (USB_CDC_RX_CAPTURE_MARKS - 1);
+        cdc_state->rx_capture_mark[mark].end = end;
+        cdc_state->rx_capture_mark[mark].time = time;
+        cdc_state->rx_capture_marked = end;
+    }
+}
+
+static size_t usb_cdc_port_rx_capture_read(int port, uint8_t *buf, size_t count) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    size_t bytes_read = 0;
+    while (bytes_read < count) {
+        uint8_t *span, *wrap_span;
+        size_t span_size;
+        size_t rx_bytes_queued = usb_cdc_port_rx_peek(port, count - bytes_read, &span, &span_size, &wrap_span);
+        memcpy(buf + bytes_read, span, span_size);
+        memcpy(buf + bytes_read + span_size, wrap_span, rx_bytes_queued - span_size);
+        usb_cdc_port_rx_consume(port, rx_bytes_queued);
+        bytes_read += rx_bytes_queued;
+    }
+    if (cdc_state->line_coding.bDataBits == usb_cdc_data_bits_7) {
+        for (size_t i = 0; i < count; i++) {
+            buf[i] &= 0x7f;
+        }
+    }
+    cdc_state->rx_bytes += count;
+    return count;
+}
+
+/* Starts and stops capture when the port mode changes, returns the port mode */
+static int usb_cdc_port_rx_capture_sync_mode(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    int rx_capture = usb_cdc_port_rx_capture_active(port);
+    if (rx_capture != cdc_state->rx_capture) {
+        cdc_state->rx_capture = rx_capture;
+        cdc_state->rx_capture_boundary = 0;
+        cdc_state->rx_capture_out = 0;
+        cdc_state->rx_capture_marked = 0;
+        cdc_state->rx_capture_mark_head = 0;
+        cdc_state->rx_capture_marks = 0;
+    }
+    return rx_capture;
+}
+
+static void usb_cdc_port_send_rx_capture(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint8_t rx_ep = usb_cdc_get_port_data_ep(port);
+    uint32_t rx_capture_in = cdc_state->rx_capture_out + usb_cdc_port_rx_count(port);
+    size_t buf_size = 0;
+    if ((int32_t)(rx_capture_in - cdc_state->rx_capture_marked) < 0) {
+        /* Marked data were overwritten by the RX DMA */
+        cdc_state->rx_capture = 0;
+        usb_cdc_port_rx_capture_sync_mode(port);
+        rx_capture_in = usb_cdc_port_rx_count(port);
+    }
+    if (cdc_state->rx_capture_boundary) {
+        cdc_state->rx_capture_boundary = 0;
+        usb_cdc_port_rx_capture_mark(port, rx_capture_in, cdc_state->rx_capture_boundary_time);
+    }
+    if ((rx_capture_in - cdc_state->rx_capture_marked) >=
+        (USB_CDC_RX_CAPTURE_BUF_SIZE - sizeof(usb_cdc_rx_capture_header_t))) {
+        usb_cdc_port_rx_capture_mark(port, rx_capture_in, system_time_now());
+    }
+    if (usb_transfer_busy(rx_ep)) {
+        return;
+    }
+    while (cdc_state->rx_capture_marks &&
+           (buf_size + sizeof(usb_cdc_rx_capture_header_t) < USB_CDC_RX_CAPTURE_BUF_SIZE)) {
+        uint8_t mark = cdc_state->rx_capture_mark_head;
+        usb_cdc_rx_capture_header_t *header = (usb_cdc_rx_capture_header_t*)&cdc_state->rx_capture_buf[buf_size];
+        size_t record_size = cdc_state->rx_capture_mark[mark].end - cdc_state->rx_capture_out;
+        size_t record_space = USB_CDC_RX_CAPTURE_BUF_SIZE - buf_size - sizeof(usb_cdc_rx_capture_header_t);
+        if (record_size > record_space) {
+            record_size = record_space;
+        }
+        header->timestamp = cdc_state->rx_capture_mark[mark].time;
+        header->size = record_size;
+        buf_size += sizeof(usb_cdc_rx_capture_header_t);
+        buf_size += usb_cdc_port_rx_capture_read(port, &cdc_state->rx_capture_buf[buf_size], record_size);
+        trace_record(trace_record_uart_rx, port, header + 1, record_size);
+        cdc_state->rx_capture_out += record_size;
+        if (cdc_state->rx_capture_out == cdc_state->rx_capture_mark[mark].end) {
+            cdc_state->rx_capture_mark_head = (mark + 1) & (USB_CDC_RX_CAPTURE_MARKS - 1);
+            cdc_state->rx_capture_marks--;
+        }
+    }
+    if (buf_size) {
+        usb_cdc_update_port_rts(port);
+        usb_transfer_send(rx_ep, cdc_state->rx_capture_buf, buf_size, 1);
+    }
+}
+
+#else
+
+static void usb_cdc_port_rx_capture_boundary(int port) {
+}
+
+#endif /* USB_CDC_RX_CAPTURE */
+
+/* USB USART RX Error Marks */
+
+#if USB_CDC_RX_ERROR_MARKS
+
+static uint8_t usb_cdc_rx_error_marks_ports = 0;
+
+void usb_cdc_set_port_rx_error_marks(int port, int enabled) {
+    if (port < USB_CDC_NUM_PORTS) {
+        if (enabled) {
+            __sync_fetch_and_or(&usb_cdc_rx_error_marks_ports, 1 << port);
+        } else {
+            __sync_fetch_and_and(&usb_cdc_rx_error_marks_ports, ~(1 << port));
+        }
+    }
+}
+
+int usb_cdc_get_port_rx_error_marks(int port) {
+    return (port < USB_CDC_NUM_PORTS) && (usb_cdc_rx_error_marks_ports & (1 << port));
+}
+
+static int usb_cdc_port_rx_error_marks_active(int port) {
+    if (!usb_cdc_get_port_rx_error_marks(port) || ((port == USB_CDC_CONFIG_PORT) && usb_cdc_config_mode)) {
+        return 0;
+    }
+#if USB_CDC_RX_CAPTURE
+    if (usb_cdc_get_port_rx_capture(port)) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/* Returns the RX DMA position of the first queued byte */
+static uint32_t usb_cdc_port_rx_tail_pos(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+#if USB_CDC_BUF_POOL
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    uint32_t primask = usb_cdc_pool_lock();
+    uint32_t rx_tail_pos = cdc_state->rx_dma_written + cdc_state->rx_block_offset;
+    if (cdc_state->rx_blocks) {
+        /* The block being filled is not counted in rx_dma_written yet */
+        size_t rx_blocks_written = cdc_state->rx_blocks - ((dma_rx_ch->CCR & DMA_CCR_EN) ? 1 : 0);
+        rx_tail_pos -= rx_blocks_written * USB_CDC_POOL_BLOCK_SIZE;
+    }
+    usb_cdc_pool_unlock(primask);
+    return rx_tail_pos;
+#else
+    /* The RX queue head is at rx_dma_written */
+    return cdc_state->rx_dma_written - usb_cdc_port_rx_count(port);
+#endif
+}
+
+static void usb_cdc_port_send_rx_error_marks(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint8_t rx_ep = usb_cdc_get_port_data_ep(port);
+    uint8_t *buf = cdc_state->rx_error_marks_buf;
+    size_t buf_size = 0;
+    if (usb_transfer_busy(rx_ep)) {
+        return;
+    }
+    uint32_t rx_pos = usb_cdc_port_rx_tail_pos(port);
+    size_t rx_bytes_available = usb_cdc_port_rx_count(port);
+    uint32_t rx_error_head = cdc_state->rx_error_head;
+    if ((rx_error_head - cdc_state->rx_error_tail) > USB_CDC_RX_ERROR_MARKS_DEPTH) {
+        cdc_state->rx_error_tail = rx_error_head - USB_CDC_RX_ERROR_MARKS_DEPTH;
+    }
+    /* Up to 3 bytes are sent for a received byte */
+    while (rx_bytes_available && (buf_size + 3 <= USB_CDC_RX_ERROR_MARKS_BUF_SIZE)) {
+        uint8_t *span, *wrap_span;
+        size_t span_size;
+        size_t rx_bytes_queued = usb_cdc_port_rx_peek(port, rx_bytes_available, &span, &span_size, &wrap_span);
+        size_t rx_bytes_read = 0;
+        while ((rx_bytes_read < rx_bytes_queued) && (buf_size + 3 <= USB_CDC_RX_ERROR_MARKS_BUF_SIZE)) {
+            uint8_t c = (rx_bytes_read < span_size) ? span[rx_bytes_read] : wrap_span[rx_bytes_read - span_size];
+            uint32_t rx_error_flags = 0;
+            if (cdc_state->line_coding.bDataBits == usb_cdc_data_bits_7) {
+                c &= 0x7f;
+            }
+            /* Errors of the dropped data are skipped */
+            while ((cdc_state->rx_error_tail != rx_error_head) &&
+                   ((int32_t)(cdc_state->rx_error[cdc_state->rx_error_tail & (USB_CDC_RX_ERROR_MARKS_DEPTH - 1)].pos - rx_pos) <= 0)) {
+                uint8_t rx_error = cdc_state->rx_error_tail & (USB_CDC_RX_ERROR_MARKS_DEPTH - 1);
+                if (cdc_state->rx_error[rx_error].pos == rx_pos) {
+                    rx_error_flags = cdc_state->rx_error[rx_error].flags;
+                }
+                cdc_state->rx_error_tail++;
+            }
+            if (rx_error_flags) {
+                buf[buf_size++] = 0xff;
+                buf[buf_size++] = 0x00;
+                if ((rx_error_flags & USART_SR_FE) && (c == 0)) {
+                    usb_cdc_serial_state_t _state;
+                    do {
+                        _state = cdc_state->serial_state;
+                    } while (!(__sync_bool_compare_and_swap(&cdc_state->serial_state, _state, (_state | USB_CDC_SERIAL_STATE_BREAK))));
+                }
+            } else if (c == 0xff) {
+                buf[buf_size++] = 0xff;
+            }
+            buf[buf_size++] = c;
+            rx_bytes_read++;
+            rx_pos++;
+        }
+        usb_cdc_port_rx_consume(port, rx_bytes_read);
+        cdc_state->rx_bytes += rx_bytes_read;
+        rx_bytes_available -= rx_bytes_read;
+    }
+    if (buf_size) {
+        trace_record(trace_record_uart_rx, port, buf, buf_size);
+        usb_cdc_update_port_rts(port);
+        usb_transfer_send(rx_ep, buf, buf_size, 1);
+    }
+}
+
+#endif /* USB_CDC_RX_ERROR_MARKS */
+
 /* USB USART RX Functions */
 
+/*
+ * RX data goes to the host in transfers, the data is taken from the RX queue
+ * a packet at a time, as the host acknowledges the packets, unless the queue
+ * has been cleared in the meantime.
+ * With the port latency timer set, only full packets are sent until the timer
+ * expires or the line goes idle, the rest of the data is sent with the first
+ * transfer after that. A stream of full packets is terminated with a ZLP then.
+ */
+
+static void usb_cdc_port_rx_usb_release(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    if (cdc_state->rx_usb_transfer_size) {
+        size_t rx_bytes_sent = usb_transfer_sent(usb_cdc_get_port_data_ep(port)) - cdc_state->rx_usb_transfer_sent;
+        if (rx_bytes_sent) {
+            usb_cdc_port_rx_consume(port, rx_bytes_sent);
+            cdc_state->rx_bytes += rx_bytes_sent;
+            cdc_state->rx_usb_transfer_sent += rx_bytes_sent;
+            cdc_state->rx_usb_transfer_size -= rx_bytes_sent;
+            usb_cdc_update_port_rts(port);
+        }
+    }
+}
+
 static void usb_cdc_port_send_rx_usb(int port) {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
     uint8_t rx_ep = usb_cdc_get_port_data_ep(port);
-    size_t rx_bytes_available = circ_buf_count(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
-    size_t ep_space_available = usb_space_available(rx_ep);
-    if (ep_space_available) {
+    usb_cdc_port_rx_usb_release(port);
+#if USB_CDC_RX_CAPTURE
+    /* The mode is switched once the pending transfer is complete */
+    if (!cdc_state->rx_usb_transfer_size && usb_cdc_port_rx_capture_sync_mode(port)) {
+        usb_cdc_port_send_rx_capture(port);
+        return;
+    }
+#endif
+#if USB_CDC_RX_ERROR_MARKS
+    if (!cdc_state->rx_usb_transfer_size && usb_cdc_port_rx_error_marks_active(port)) {
+        usb_cdc_port_send_rx_error_marks(port);
+        return;
+    }
+#endif
+    if (!usb_transfer_busy(rx_ep)) {
+        uint8_t latency_timer = device_config_get()->cdc_config.port_config[port].latency_timer;
+        int latency_timer_expired = (latency_timer == 0) || (cdc_state->rx_latency_timer == 0) ||
+                                    cdc_state->rx_flush_pending;
+        cdc_state->rx_flush_pending = 0;
+        size_t rx_bytes_available = usb_cdc_port_rx_count(port);
+        if (!latency_timer_expired) {
+            size_t packet_size = usb_endpoints[rx_ep].tx_size;
+            rx_bytes_available -= rx_bytes_available % packet_size;
+        }
         if (rx_bytes_available) {
-            if (cdc_state->line_coding.bDataBits == usb_cdc_data_bits_7) {
-                size_t bytes_count = ep_space_available < rx_bytes_available ? ep_space_available : rx_bytes_available;
-                uint8_t *buf_ptr = &rx_buf->data[rx_buf->tail];
-                while (bytes_count--) {
-                    *(buf_ptr++) &= 0x7f;
+            uint8_t *span, *wrap_span;
+            size_t span_size;
+            size_t rx_bytes_queued = usb_cdc_port_rx_peek(port, rx_bytes_available, &span, &span_size, &wrap_span);
+            if (rx_bytes_queued < rx_bytes_available) {
+                /* The rest is sent with the next transfer */
+                if (latency_timer_expired) {
+                    cdc_state->rx_flush_pending = 1;
                 }
+                latency_timer_expired = 0;
+                rx_bytes_available = rx_bytes_queued;
             }
-            cdc_state->rx_zlp_pending = (usb_circ_buf_send(rx_ep, rx_buf, USB_CDC_BUF_SIZE) == ep_space_available);
-            usb_cdc_update_port_rts(port);
-        } else {
-            if (cdc_state->rx_zlp_pending) {
-                cdc_state->rx_zlp_pending = 0;
-                usb_send(rx_ep, 0, 0);
+            if (cdc_state->line_coding.bDataBits == usb_cdc_data_bits_7) {
+                for (size_t i = 0; i < span_size; i++) {
+                    span[i] &= 0x7f;
+                }
+                for (size_t i = 0; i < rx_bytes_available - span_size; i++) {
+                    wrap_span[i] &= 0x7f;
+                }
             }
+            trace_record_spans(trace_record_uart_rx, port, span, span_size,
+                               wrap_span, rx_bytes_available - span_size);
+            cdc_state->rx_usb_transfer_size = rx_bytes_available;
+            cdc_state->rx_usb_transfer_sent = 0;
+            cdc_state->rx_usb_zlp_pending = !latency_timer_expired;
+            cdc_state->rx_latency_timer = latency_timer;
+            usb_transfer_send_spans(rx_ep, span, span_size,
+                                    wrap_span, rx_bytes_available - span_size, latency_timer_expired);
+        } else if (latency_timer_expired && cdc_state->rx_usb_zlp_pending) {
+            cdc_state->rx_usb_zlp_pending = 0;
+            cdc_state->rx_latency_timer = latency_timer;
+            usb_transfer_send(rx_ep, 0, 0, 0);
         }
     }
 }
 
+static void usb_cdc_port_rx_latency_tick(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    if (cdc_state->rx_latency_timer) {
+        if (cdc_state->rx_usb_zlp_pending || usb_cdc_port_rx_count(port)) {
+            cdc_state->rx_latency_timer--;
+        }
+    }
+}
+
+#if USB_CDC_BUF_POOL
+
+static void usb_cdc_port_start_rx(int port) {
+    usb_cdc_port_rx_clear(port);
+    usb_cdc_port_rx_errors_clear(port);
+    uint32_t primask = usb_cdc_pool_lock();
+    if (usb_cdc_pool_append_block(port)) {
+        usb_cdc_port_rx_arm_dma(port);
+    } else {
+        usb_cdc_states[port].rx_dma_stalled = 1;
+    }
+    usb_cdc_pool_unlock(primask);
+}
+
+static void usb_cdc_sync_rx_buffer(int port) {
+    usb_cdc_update_port_rts(port);
+}
+
+static void usb_cdc_port_rx_block_complete(int port) {
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    dma_rx_ch->CCR &= ~(DMA_CCR_EN);
+    cdc_state->rx_block_fill = USB_CDC_POOL_BLOCK_SIZE;
+    cdc_state->rx_dma_written += USB_CDC_POOL_BLOCK_SIZE;
+    usb_cdc_port_rx_capture_boundary(port);
+    uint32_t primask = usb_cdc_pool_lock();
+    if (usb_cdc_pool_append_block(port)) {
+        usb_cdc_port_rx_arm_dma(port);
+    } else {
+        cdc_state->rx_dma_stalled = 1;
+        usb_cdc_notify_port_overrun(port);
+    }
+    usb_cdc_pool_unlock(primask);
+    usb_poll_request();
+}
+
+#else
+
 static void usb_cdc_port_start_rx(int port) {
     DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
+    circ_buf_t *rx_buf = cdc_state->rx_buf;
     dma_rx_ch->CCR &= ~(DMA_CCR_EN);
     dma_rx_ch->CMAR = (uint32_t)&rx_buf->data;
-    dma_rx_ch->CNDTR = USB_CDC_BUF_SIZE;
+    dma_rx_ch->CNDTR = cdc_state->rx_buf_size;
+    /* Stale half and complete flags must not be counted */
+    DMA1->IFCR = usb_cdc_get_port_rx_dma_flags(port);
+    cdc_state->rx_dma_halves = 0;
+    cdc_state->rx_dma_written = 0;
+    usb_cdc_port_rx_errors_clear(port);
     dma_rx_ch->CCR |= DMA_CCR_EN;
+    usb_cdc_port_rx_clear(port);
 }
 
+/*
+ * If the RX DMA has overwritten unread data, the oldest data are dropped
+ * and counted as lost. The transfer to the host is stopped, the data it has
+ * not sent yet are dropped with them instead of being read from the overwritten ring.
+ */
 static void usb_cdc_sync_rx_buffer(int port) {
-    circ_buf_t *rx_buf = &usb_cdc_states[port].rx_buf;
-    int rx_buf_tail = rx_buf->tail;
-    size_t current_rx_bytes_available = circ_buf_count(rx_buf->head, rx_buf_tail, USB_CDC_BUF_SIZE);
-    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
-    size_t dma_head = USB_CDC_BUF_SIZE - dma_rx_ch->CNDTR;
-    size_t dma_rx_bytes_available = circ_buf_count(dma_head, rx_buf_tail, USB_CDC_BUF_SIZE);
-    usb_cdc_update_port_rts(port);
-    if (dma_rx_bytes_available < current_rx_bytes_available) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    circ_buf_t *rx_buf = cdc_state->rx_buf;
+    size_t rx_buf_size = cdc_state->rx_buf_size;
+    usb_cdc_port_rx_usb_release(port);
+    uint32_t rx_dma_written = usb_cdc_port_rx_dma_written(port);
+    uint32_t rx_bytes_available = circ_buf_count(rx_buf->head, rx_buf->tail, rx_buf_size) +
+                                  (rx_dma_written - cdc_state->rx_dma_written);
+    cdc_state->rx_dma_written = rx_dma_written;
+    if (rx_bytes_available > (rx_buf_size - 1)) {
+        uint32_t rx_lost_bytes = rx_bytes_available - (rx_buf_size - 1);
+        size_t rx_bytes_dropped = rx_lost_bytes;
+        if (rx_bytes_dropped < cdc_state->rx_usb_transfer_size) {
+            rx_bytes_dropped = cdc_state->rx_usb_transfer_size;
+        }
+        rx_buf->tail = (rx_buf->tail + rx_bytes_dropped) & (rx_buf_size - 1);
+        usb_cdc_port_rx_usb_stop(port);
+        cdc_state->rx_lost_bytes += rx_lost_bytes;
+#if USB_CDC_RX_CAPTURE
+        cdc_state->rx_capture = 0; /* Restarted by the next poll */
+#endif
         usb_cdc_notify_port_overrun(port);
     }
-    rx_buf->head = dma_head;
+    rx_buf->head = rx_dma_written & (rx_buf_size - 1);
+    usb_cdc_update_port_rts(port);
+}
+
+#endif /* USB_CDC_BUF_POOL */
+
+/* Line Coding Barriers */
+
+/*
+ * The barrier position counts the data already in the TX buffer, a read still
+ * copied by the PMA DMA and a held OUT packet, all received before the request.
+ * The TX DMA is never started past the first barrier, so the position is reached exactly.
+ */
+static void usb_cdc_port_queue_line_coding(int port, const usb_cdc_line_coding_t *line_coding) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_buf_size = cdc_state->tx_buf_size;
+    usb_cdc_line_coding_barrier_t *barrier;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t tx_pos = cdc_state->tx_bytes + circ_buf_count(tx_buf->head, tx_buf->tail, tx_buf_size) +
+                      usb_circ_buf_read_pending(tx_buf);
+    if (cdc_state->usb_rx_pending_ep) {
+        tx_pos += usb_bytes_available(cdc_state->usb_rx_pending_ep);
+    }
+    uint8_t count = cdc_state->line_coding_barriers_count;
+    barrier = &cdc_state->line_coding_barriers[(cdc_state->line_coding_barriers_first + count +
+                                                USB_CDC_LINE_CODING_BARRIERS - 1) % USB_CDC_LINE_CODING_BARRIERS];
+    if (count && ((count == USB_CDC_LINE_CODING_BARRIERS) || (barrier->tx_pos == tx_pos))) {
+        barrier->line_coding = *line_coding;
+    } else {
+        barrier = &cdc_state->line_coding_barriers[(cdc_state->line_coding_barriers_first + count) %
+                                                   USB_CDC_LINE_CODING_BARRIERS];
+        barrier->tx_pos = tx_pos;
+        barrier->line_coding = *line_coding;
+        cdc_state->line_coding_barriers_count = count + 1;
+    }
+    __set_PRIMASK(primask);
+}
+
+/* Limits the TX DMA transfer to the data before the first barrier */
+static size_t usb_cdc_port_tx_barrier_limit(int port, size_t tx_bytes_available) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    if (cdc_state->line_coding_barriers_count) {
+        usb_cdc_line_coding_barrier_t *barrier = &cdc_state->line_coding_barriers[cdc_state->line_coding_barriers_first];
+        size_t tx_bytes_before = barrier->tx_pos - cdc_state->tx_bytes;
+        if (tx_bytes_before < tx_bytes_available) {
+            tx_bytes_available = tx_bytes_before;
+        }
+        if (tx_bytes_before == 0) {
+            cdc_state->line_coding_barrier_reached = 1;
+        }
+    }
+    return tx_bytes_available;
+}
+
+/* Called once the USART has sent the last byte before the first barrier */
+static void usb_cdc_port_apply_line_coding(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    usb_cdc_line_coding_barrier_t *barrier = &cdc_state->line_coding_barriers[cdc_state->line_coding_barriers_first];
+    usb_cdc_line_coding_t line_coding = cdc_state->line_coding;
+    uint32_t line_coding_rate = cdc_state->line_coding_rate;
+    usb_cdc_set_line_coding(port, &barrier->line_coding, 0);
+    /* The host reads back the last line coding it has set */
+    cdc_state->line_coding = line_coding;
+    cdc_state->line_coding_rate = line_coding_rate;
+    cdc_state->line_coding_barriers_first = (cdc_state->line_coding_barriers_first + 1) % USB_CDC_LINE_CODING_BARRIERS;
+    cdc_state->line_coding_barriers_count--;
+    cdc_state->line_coding_barrier_reached = 0;
+    cdc_state->line_state_change_ready = 0;
+}
+
+static void usb_cdc_port_line_coding_barriers_clear(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    cdc_state->line_coding_barriers_count = 0;
+    cdc_state->line_coding_barrier_reached = 0;
+    cdc_state->line_state_change_ready = 0;
 }
 
 /* Configuration Mode Handling */
@@ -374,21 +1485,20 @@ void usb_cdc_config_mode_enter() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
     USART_TypeDef *usart = usb_cdc_get_port_usart(USB_CDC_CONFIG_PORT);
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(USB_CDC_CONFIG_PORT, usb_cdc_port_direction_tx);
-    cdc_state->rx_buf.tail = cdc_state->rx_buf.head = 0;
-    cdc_state->tx_buf.tail = cdc_state->tx_buf.head = 0;
     usart->CR1 &= ~(USART_CR1_RE);
+    usb_cdc_port_rx_clear(USB_CDC_CONFIG_PORT);
+    cdc_state->tx_buf->tail = cdc_state->tx_buf->head = 0;
     dma_tx_ch->CCR &= ~(DMA_CCR_EN);
+    usb_cdc_port_line_coding_barriers_clear(USB_CDC_CONFIG_PORT);
     cdc_shell_init();
     usb_cdc_config_mode = 1;
 }
 
 void usb_cdc_config_mode_leave() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(USB_CDC_CONFIG_PORT, usb_cdc_port_direction_rx);
-    size_t dma_head = USB_CDC_BUF_SIZE - dma_rx_ch->CNDTR;
     USART_TypeDef *usart = usb_cdc_get_port_usart(USB_CDC_CONFIG_PORT);
-    cdc_state->rx_buf.tail = cdc_state->rx_buf.head = dma_head;
-    cdc_state->tx_buf.tail = cdc_state->tx_buf.head = 0;
+    usb_cdc_port_start_rx(USB_CDC_CONFIG_PORT);
+    cdc_state->tx_buf->tail = cdc_state->tx_buf->head = 0;
     usart->CR1 |= USART_CR1_RE;
     usb_cdc_config_mode = 0;
 }
@@ -396,141 +1506,288 @@ void usb_cdc_config_mode_leave() {
 /*
  * USB_CDC_CONFIG_PORT buffers are reused for the config shell.
  * usb_cdc_config_process_tx must ensure enough tx buf space is available
- * for the next usb transfer.
+ * for the next usb transfer. While the shell prints the output of a command
+ * in parts, the input is left in the tx buf and the next packet is held.
  */
 
-void usb_cdc_config_mode_process_tx() {
-    uint8_t ep_num = usb_cdc_get_port_data_ep(USB_CDC_CONFIG_PORT);
+static void usb_cdc_config_mode_process_input() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_buf_size = cdc_state->tx_buf_size;
     size_t count;
-    if (usb_bytes_available(ep_num) < circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE)) {
-        usb_circ_buf_read(ep_num, tx_buf, USB_CDC_BUF_SIZE);
+    while(!cdc_shell_busy() && (count = circ_buf_count_to_end(tx_buf->head, tx_buf->tail, tx_buf_size))) {
+        count = cdc_shell_process_input(&tx_buf->data[tx_buf->tail], count);
+        tx_buf->tail  = (tx_buf->tail + count) & (tx_buf_size - 1);
+    }
+}
+
+void usb_cdc_config_mode_process_tx() {
+    uint8_t ep_num = usb_cdc_get_port_data_out_ep(USB_CDC_CONFIG_PORT);
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_buf_size = cdc_state->tx_buf_size;
+    if (cdc_shell_busy()) {
+        cdc_state->usb_rx_pending_ep = ep_num;
+        return;
+    }
+    if (usb_bytes_available(ep_num) < circ_buf_space(tx_buf->head, tx_buf->tail, tx_buf_size)) {
+        usb_circ_buf_read(ep_num, tx_buf, tx_buf_size);
     } else {
         usb_panic();
     }
-    while((count = circ_buf_count_to_end(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE))) {
-        cdc_shell_process_input(&tx_buf->data[tx_buf->tail], count);
-        tx_buf->tail  = (tx_buf->tail + count) & (USB_CDC_BUF_SIZE - 1);
-    }
+    usb_cdc_config_mode_process_input();
 }
 
-void cdc_shell_write(const void *buf, size_t count) {
+/* The next part of the shell output is printed once the previous one is sent */
+static void usb_cdc_config_mode_poll() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
-    while (count) {
-        size_t bytes_to_copy;
-        size_t space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
-        if (space_available == 0) {
-            rx_buf->tail = rx_buf->head;
-            space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
+    if (cdc_shell_busy() && (usb_cdc_port_rx_count(USB_CDC_CONFIG_PORT) == 0)) {
+        cdc_shell_poll();
+        usb_cdc_config_mode_process_input();
+        if (!cdc_shell_busy() && cdc_state->usb_rx_pending_ep) {
+            cdc_state->usb_rx_pending_ep = 0;
+            usb_cdc_config_mode_process_tx();
         }
-        bytes_to_copy = (space_available > count) ? count : space_available;
-        memcpy(&rx_buf->data[rx_buf->head], buf, bytes_to_copy);
-        rx_buf->head = (rx_buf->head + bytes_to_copy) & (USB_CDC_BUF_SIZE - 1);
-        count -= bytes_to_copy;
-        buf = (uint8_t*)buf + bytes_to_copy;
     }
 }
 
+void cdc_shell_write(const void *buf, size_t count) {
+    usb_cdc_port_rx_write(USB_CDC_CONFIG_PORT, buf, count);
+}
+
 /* USB USART TX Functions */
 
+#if USB_CDC_TX_DMA_EXTEND
+
+/*
+ * The DMA cannot resize an enabled transfer, so the channel is disabled,
+ * the bytes sent so far are released and the transfer is restarted from
+ * the first unsent byte. The USART holds a byte in the data register, so
+ * there is no gap on the line. If the transfer has just completed, the DMA
+ * interrupt is pending and starts the next transfer.
+ */
+static void usb_cdc_port_extend_tx(int port) {
+    DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_buf_size = cdc_state->tx_buf_size;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    dma_tx_ch->CCR &= ~(DMA_CCR_EN);
+    size_t dma_tx_remaining = dma_tx_ch->CNDTR;
+    if (dma_tx_remaining) {
+        size_t dma_tx_sent = cdc_state->last_dma_tx_size - dma_tx_remaining;
+        tx_buf->tail = (tx_buf->tail + dma_tx_sent) & (tx_buf_size - 1);
+        cdc_state->tx_bytes += dma_tx_sent;
+        size_t tx_bytes_available = usb_cdc_port_tx_barrier_limit(port,
+            circ_buf_count_to_end(tx_buf->head, tx_buf->tail, tx_buf_size));
+        dma_tx_ch->CMAR = (uint32_t)&tx_buf->data[tx_buf->tail];
+        dma_tx_ch->CNDTR = tx_bytes_available;
+        dma_tx_ch->CCR |= DMA_CCR_EN;
+        cdc_state->last_dma_tx_size = tx_bytes_available;
+        event_trace_write(event_trace_extend_tx, port, tx_bytes_available);
+    }
+    __set_PRIMASK(primask);
+}
+
+#endif /* USB_CDC_TX_DMA_EXTEND */
+
 static void usb_cdc_port_start_tx(int port) {
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
-    size_t tx_bytes_available = circ_buf_count_to_end(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_bytes_available = usb_cdc_port_tx_barrier_limit(port,
+        circ_buf_count_to_end(tx_buf->head, tx_buf->tail, cdc_state->tx_buf_size));
     int dma_ch_busy = dma_tx_ch->CCR & DMA_CCR_EN;
     if (!dma_ch_busy) {
+        USART_TypeDef *usart = usb_cdc_get_port_usart(port);
         if (tx_bytes_available) {
             usb_cdc_set_port_txa(port, 1);
+            /* TC is cleared by writing 0, the other rc_w0 flags are written 1 and left intact */
+            usart->SR = USART_SR_CTS | USART_SR_LBD | USART_SR_RXNE;
             dma_tx_ch->CMAR = (uint32_t)&tx_buf->data[tx_buf->tail];
             dma_tx_ch->CNDTR = tx_bytes_available;
             dma_tx_ch->CCR |= DMA_CCR_EN;
             cdc_state->last_dma_tx_size = tx_bytes_available;
+            event_trace_write(event_trace_start_tx, port, tx_bytes_available);
         } else {
-            USART_TypeDef *usart = usb_cdc_get_port_usart(port);
-            usart->SR &= ~(USART_SR_TC);
+            /* TC was cleared when the last transfer started, it is set once the last byte is sent */
+            event_trace_write(event_trace_start_tx, port, 0);
             usart->CR1 |= USART_CR1_TCIE;
         }
     }
+#if USB_CDC_TX_DMA_EXTEND
+    if (dma_ch_busy && (tx_bytes_available > cdc_state->last_dma_tx_size)) {
+        usb_cdc_port_extend_tx(port);
+    }
+#endif
 }
 
 static void usb_cdc_port_tx_complete(int port) {
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
-    tx_buf->tail = (tx_buf->tail + cdc_state->last_dma_tx_size) & (USB_CDC_BUF_SIZE - 1);
+    circ_buf_t *tx_buf = cdc_state->tx_buf;
+    size_t tx_buf_size = cdc_state->tx_buf_size;
+    tx_buf->tail = (tx_buf->tail + cdc_state->last_dma_tx_size) & (tx_buf_size - 1);
+    cdc_state->tx_bytes += cdc_state->last_dma_tx_size;
+    event_trace_write(event_trace_dma_tx_complete, port, cdc_state->last_dma_tx_size);
     dma_tx_ch->CCR &= ~(DMA_CCR_EN);
-    if (cdc_state->line_state_change_pending) {
-        size_t tx_bytes_available = circ_buf_count(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
-        if (tx_bytes_available == 0) {
-            cdc_state->line_state_change_ready = 1;
-        }
-    }
     if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
         usb_cdc_port_start_tx(port);
     } else {
         usb_cdc_set_port_txa(port, 0);
         usb_cdc_config_mode_process_tx(port);
     }
+    usb_poll_request();
 }
 
 /* DMA Interrupt Handlers */
 
 void DMA1_Channel4_IRQHandler() {
     (void)DMA1_Channel4_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF4 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(0);
+    perf_probe_end(perf_probe_dma1_ch4, perf_start);
 }
 
 void DMA1_Channel7_IRQHandler() {
     (void)DMA1_Channel7_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF7 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(1);
+    perf_probe_end(perf_probe_dma1_ch7, perf_start);
 }
 
 void DMA1_Channel2_IRQHandler() {
     (void)DMA1_Channel2_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF2 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(2);
+    perf_probe_end(perf_probe_dma1_ch2, perf_start);
+}
+
+#if USB_CDC_BUF_POOL
+
+void DMA1_Channel5_IRQHandler() {
+    (void)DMA1_Channel5_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF5 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_block_complete(0);
+    perf_probe_end(perf_probe_dma1_ch5, perf_start);
+}
+
+void DMA1_Channel6_IRQHandler() {
+    (void)DMA1_Channel6_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF6 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_block_complete(1);
+    perf_probe_end(perf_probe_dma1_ch6, perf_start);
+}
+
+void DMA1_Channel3_IRQHandler() {
+    (void)DMA1_Channel3_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF3 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_block_complete(2);
+    perf_probe_end(perf_probe_dma1_ch3, perf_start);
+}
+
+#else
+
+void DMA1_Channel5_IRQHandler() {
+    (void)DMA1_Channel5_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_HTIF5 | DMA_ISR_TCIF5 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_dma_half_complete(0, !!(status & DMA_ISR_HTIF5) + !!(status & DMA_ISR_TCIF5));
+    perf_probe_end(perf_probe_dma1_ch5, perf_start);
+}
+
+void DMA1_Channel6_IRQHandler() {
+    (void)DMA1_Channel6_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_HTIF6 | DMA_ISR_TCIF6 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_dma_half_complete(1, !!(status & DMA_ISR_HTIF6) + !!(status & DMA_ISR_TCIF6));
+    perf_probe_end(perf_probe_dma1_ch6, perf_start);
 }
 
+void DMA1_Channel3_IRQHandler() {
+    (void)DMA1_Channel3_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_HTIF3 | DMA_ISR_TCIF3 );
+    DMA1->IFCR = status;
+    usb_cdc_port_rx_dma_half_complete(2, !!(status & DMA_ISR_HTIF3) + !!(status & DMA_ISR_TCIF3));
+    perf_probe_end(perf_probe_dma1_ch3, perf_start);
+}
+
+#endif /* USB_CDC_BUF_POOL */
+
 /* USART Interrupt Handlers */
 
 __attribute__((always_inline)) inline static void usb_cdc_usart_irq_handler(int port, USART_TypeDef * usart,
     volatile uint32_t *txa_bitband_clear) {
-    uint32_t wait_rxne = 0;
     uint32_t status = usart->SR;
     if (status & USART_SR_TC) {
         *txa_bitband_clear = 1;
         usart->CR1 &= ~(USART_CR1_TCIE);
+        /* The last byte before the line coding barrier is sent, the new line coding is applied by usb_cdc_poll */
+        if (usb_cdc_states[port].line_coding_barrier_reached) {
+            usb_cdc_states[port].line_state_change_ready = 1;
+            usb_poll_request();
+        }
+    }
+    /* Flush received data, IDLE interrupt is re-enabled on the next USB frame */
+    if (status & USART_SR_IDLE) {
+        *usb_cdc_get_usart_bitband_addr(&usart->CR1, USART_CR1_IDLEIE_Pos) = 0;
+        usb_cdc_states[port].rx_flush_pending = 1;
+        usb_cdc_port_rx_capture_boundary(port);
+        usb_poll_request();
     }
     /* Synchronization is not required, no one can interrupt us */
-    if (status & USART_SR_PE) {
-        wait_rxne = 1;
-        usb_cdc_states[port].serial_state |= USB_CDC_SERIAL_STATE_PARITY_ERROR;
+    if (!(usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx)->CCR & DMA_CCR_EN)) {
+        /* The RX DMA is stopped (no free pool block), the byte is dropped to clear the flags */
+        (void)usart->DR;
+        if (status & (USART_SR_RXNE | USART_SR_ORE)) {
+            usb_cdc_notify_port_overrun(port);
+        }
+        return;
+    }
+    if (status & (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)) {
+        usb_cdc_port_rx_error(port, usart, status);
+    }
+    /* A byte not yet read by the RX DMA must be left to it, the RX DMA read clears the flags */
+    if (!(usart->SR & USART_SR_RXNE)) {
+        (void)usart->DR;
     }
-    while (wait_rxne && (usart->SR & USART_SR_RXNE));
-    (void)usart->DR;
 }
 
 void USART1_IRQHandler() {
     (void)USART1_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     usb_cdc_usart_irq_handler(0, usb_cdc_port_usarts[0], usb_cdc_states[0].txa_bitband_clear);
+    perf_probe_end(perf_probe_usart1, perf_start);
 }
 
 void USART2_IRQHandler() {
     (void)USART2_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     usb_cdc_usart_irq_handler(1, usb_cdc_port_usarts[1], usb_cdc_states[1].txa_bitband_clear);
+    perf_probe_end(perf_probe_usart2, perf_start);
 }
 
 void USART3_IRQHandler() {
     (void)USART3_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
     usb_cdc_usart_irq_handler(2, usb_cdc_port_usarts[2], usb_cdc_states[2].txa_bitband_clear);
+    perf_probe_end(perf_probe_usart3, perf_start);
 }
 
 /* Port Configuration & Control Lines Functions */
@@ -568,8 +1825,69 @@ void usb_cdc_reconfigure() {
     }
 }
 
+/* Port Statistics */
+
+static void usb_cdc_update_port_rx_peak(int port) {
+    size_t rx_bytes_queued = usb_cdc_port_rx_count(port);
+    if (rx_bytes_queued > usb_cdc_states[port].rx_peak) {
+        usb_cdc_states[port].rx_peak = rx_bytes_queued;
+    }
+}
+
+static void usb_cdc_update_port_tx_peak(int port, size_t tx_space_available, size_t rx_bytes_available) {
+    size_t tx_bytes_queued = usb_cdc_states[port].tx_buf_size - 1 - tx_space_available + rx_bytes_available;
+    if (tx_bytes_queued > usb_cdc_states[port].tx_peak) {
+        usb_cdc_states[port].tx_peak = tx_bytes_queued;
+    }
+}
+
+static uint32_t usb_cdc_rate_ewma(uint32_t rate, uint32_t bytes) {
+    int32_t sample_rate = bytes * (1000 / USB_CDC_RATE_INTERVAL);
+    return rate + ((sample_rate - (int32_t)rate) >> USB_CDC_RATE_EWMA_SHIFT);
+}
+
+static void usb_cdc_update_port_rates(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint32_t rx_bytes = cdc_state->rx_bytes;
+    uint32_t tx_bytes = cdc_state->tx_bytes;
+    cdc_state->rx_rate = usb_cdc_rate_ewma(cdc_state->rx_rate, rx_bytes - cdc_state->rx_bytes_prev);
+    cdc_state->tx_rate = usb_cdc_rate_ewma(cdc_state->tx_rate, tx_bytes - cdc_state->tx_bytes_prev);
+    cdc_state->rx_bytes_prev = rx_bytes;
+    cdc_state->tx_bytes_prev = tx_bytes;
+}
+
+void usb_cdc_get_port_stats(int port, usb_cdc_port_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (port < USB_CDC_NUM_PORTS) {
+        const usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+        stats->rx_bytes = cdc_state->rx_bytes;
+        stats->tx_bytes = cdc_state->tx_bytes;
+        stats->rx_rate = cdc_state->rx_rate;
+        stats->tx_rate = cdc_state->tx_rate;
+        stats->rx_overruns = cdc_state->rx_overruns;
+#if !USB_CDC_BUF_POOL
+        stats->rx_lost_bytes = cdc_state->rx_lost_bytes;
+#endif
+        stats->parity_errors = cdc_state->parity_errors;
+        stats->framing_errors = cdc_state->framing_errors;
+        stats->noise_errors = cdc_state->noise_errors;
+        stats->usb_out_naks = cdc_state->usb_out_naks;
+        stats->rx_peak = cdc_state->rx_peak;
+        stats->tx_peak = cdc_state->tx_peak;
+#if USB_CDC_BUF_POOL
+        stats->rx_blocks = cdc_state->rx_blocks;
+        stats->rx_blocks_peak = cdc_state->rx_blocks_peak;
+#endif
+    }
+}
+
 /* Device Lifecycle */
 
+void usb_cdc_init() {
+    usb_cdc_init_buf_sizes();
+    usb_cdc_alloc_buffers();
+}
+
 void usb_cdc_reset() {
     const device_config_t *device_config = device_config_get();
     usb_cdc_enabled = 0;
@@ -579,6 +1897,17 @@ void usb_cdc_reset() {
     NVIC_EnableIRQ(DMA1_Channel4_IRQn);
     NVIC_SetPriority(DMA1_Channel7_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
     NVIC_EnableIRQ(DMA1_Channel7_IRQn);
+#if USB_CDC_BUF_POOL
+    /* The next block must be set up before the USART receives another byte */
+#else
+    /* RX buffer halves are counted exactly if served within half of the buffer time */
+#endif
+    NVIC_SetPriority(DMA1_Channel5_IRQn, SYSTEM_INTERRUTPS_PRIORITY_CRITICAL);
+    NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+    NVIC_SetPriority(DMA1_Channel6_IRQn, SYSTEM_INTERRUTPS_PRIORITY_CRITICAL);
+    NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+    NVIC_SetPriority(DMA1_Channel3_IRQn, SYSTEM_INTERRUTPS_PRIORITY_CRITICAL);
+    NVIC_EnableIRQ(DMA1_Channel3_IRQn);
     /* 
      * Disable JTAG interface (SWD is still enabled),
      * this frees PA15, PB3, PB4 (needed for DSR/RI inputs).
@@ -599,8 +1928,13 @@ void usb_cdc_reset() {
     RCC->APB1RSTR &= ~(RCC_APB1RSTR_USART3RST);
     memset(&usb_cdc_states, 0, sizeof(usb_cdc_states));
     for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
-        (void)usb_cdc_states[port]._rx_data;
-        (void)usb_cdc_states[port]._tx_data;
+        DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+        DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
+        dma_rx_ch->CCR &= ~(DMA_CCR_EN);
+        dma_tx_ch->CCR &= ~(DMA_CCR_EN);
+    }
+    usb_cdc_alloc_buffers();
+    for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
         usb_cdc_configure_port(port);
         USART_TypeDef *usart = usb_cdc_get_port_usart(port);
         DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
@@ -611,10 +1945,14 @@ void usb_cdc_reset() {
             usart->CR3 |= USART_CR3_CTSE;
         }
         usb_cdc_set_line_coding(port, &usb_cdc_default_line_coding, 0);
-        dma_rx_ch->CCR |= DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_PL_0;
         dma_rx_ch->CPAR = (uint32_t)&usart->DR;
-        dma_rx_ch->CMAR = (uint32_t)usb_cdc_states[port].rx_buf.data;
-        dma_rx_ch->CNDTR = USB_CDC_BUF_SIZE;
+#if USB_CDC_BUF_POOL
+        dma_rx_ch->CCR |= DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_PL_0;
+#else
+        dma_rx_ch->CCR |= DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_PL_0;
+        dma_rx_ch->CMAR = (uint32_t)usb_cdc_states[port].rx_buf->data;
+        dma_rx_ch->CNDTR = usb_cdc_states[port].rx_buf_size;
+#endif
         dma_tx_ch->CCR |= DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE;
         dma_tx_ch->CPAR = (uint32_t)&usart->DR;
     }
@@ -630,8 +1968,12 @@ void usb_cdc_enable() {
     usb_cdc_enabled = 1;
     for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
         USART_TypeDef *usart = usb_cdc_get_port_usart(port);
-        usb_cdc_port_start_rx(port);
-        usart->CR1 |= USART_CR1_PEIE | USART_CR1_IDLEIE | USART_CR1_RE | USART_CR1_PEIE;
+        usart->CR1 |= USART_CR1_PEIE | USART_CR1_IDLEIE;
+        /* The config shell owns the port RX buffer until the config mode is left */
+        if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
+            usb_cdc_port_start_rx(port);
+            usart->CR1 |= USART_CR1_RE;
+        }
     }
 }
 
@@ -647,6 +1989,12 @@ void usb_cdc_frame() {
     if (usb_cdc_enabled) {
         const device_config_t *device_config = device_config_get();
         static unsigned int ctrl_lines_polling_timer = 0;
+        static unsigned int rate_timer = 0;
+        for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+            USART_TypeDef *usart = usb_cdc_get_port_usart(port);
+            *usb_cdc_get_usart_bitband_addr(&usart->CR1, USART_CR1_IDLEIE_Pos) = 1;
+            usb_cdc_port_rx_latency_tick(port);
+        }
         if (ctrl_lines_polling_timer == 0) {
             ctrl_lines_polling_timer = USB_CDC_CRTL_LINES_POLLING_INTERVAL;
             for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
@@ -677,6 +2025,14 @@ void usb_cdc_frame() {
         } else {
             ctrl_lines_polling_timer = ctrl_lines_polling_timer - 1;
         }
+        if (rate_timer == 0) {
+            rate_timer = USB_CDC_RATE_INTERVAL - 1;
+            for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+                usb_cdc_update_port_rates(port);
+            }
+        } else {
+            rate_timer = rate_timer - 1;
+        }
     }
 }
 
@@ -687,20 +2043,25 @@ void usb_cdc_data_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event_t ep
     if (port != -1) {
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
         if (ep_event == usb_endpoint_event_data_received) {
-            circ_buf_t *tx_buf = &cdc_state->tx_buf;
-            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
+            circ_buf_t *tx_buf = cdc_state->tx_buf;
+            size_t tx_buf_size = cdc_state->tx_buf_size;
+            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, tx_buf_size);
             size_t rx_bytes_available = usb_bytes_available(ep_num);
             if ((port == USB_CDC_CONFIG_PORT) && usb_cdc_config_mode) {
                 usb_cdc_config_mode_process_tx(port);
             } else {
-                /* Do not receive data until line state change is complete */
-                if ((tx_space_available < rx_bytes_available) || (cdc_state->line_state_change_pending)) {
+                if (tx_space_available < rx_bytes_available) {
+                    cdc_state->usb_out_naks++;
+                    event_trace_write(event_trace_usb_out_hold, port, EVENT_TRACE_OUT_HOLD_TX_BUF_FULL);
                     cdc_state->usb_rx_pending_ep = ep_num;
                 } else {
-                    usb_circ_buf_read(ep_num, tx_buf, USB_CDC_BUF_SIZE);
+                    usb_cdc_update_port_tx_peak(port, tx_space_available, rx_bytes_available);
+                    usb_circ_buf_read_async(ep_num, tx_buf, tx_buf_size);
                     usb_cdc_port_start_tx(port);
                 }
             }
+        } else if (ep_event == usb_endpoint_event_data_read) {
+            usb_cdc_port_start_tx(port);
         }
     }
 }
@@ -718,19 +2079,19 @@ usb_status_t usb_cdc_ctrl_process_request(usb_setup_t *setup, void **payload,
             case usb_cdc_request_set_line_coding: {
                 usb_cdc_line_coding_t *line_coding = (usb_cdc_line_coding_t *)setup->payload;
                 if (setup->wLength == sizeof(usb_cdc_line_coding_t)) {
-                    int dry_run = 0;
-                    circ_buf_t *tx_buf = &usb_cdc_states[port].tx_buf;
                     /* 
-                     * If the TX buffer is not empty, defer setting
-                     * line coding until all data are sent over the serial port.
+                     * Defer setting line coding until the data received
+                     * before the request are sent over the serial port.
                      */
                     if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
-                        if (circ_buf_count(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE) != 0) {
-                            dry_run = 1;
-                            usb_cdc_states[port].line_state_change_pending = 1;
+                        usb_status_t status = usb_cdc_set_line_coding(port, line_coding, 1);
+                        if (status == usb_status_ack) {
+                            usb_cdc_port_queue_line_coding(port, line_coding);
+                            usb_cdc_port_start_tx(port);
                         }
+                        return status;
                     }
-                    return usb_cdc_set_line_coding(port, line_coding, dry_run);
+                    return usb_cdc_set_line_coding(port, line_coding, 0);
                 }
                 break;
             }
@@ -749,28 +2110,42 @@ usb_status_t usb_cdc_ctrl_process_request(usb_setup_t *setup, void **payload,
     return usb_status_fail;
 }
 
+/* 
+ * In interrupt-driven mode usb_cdc_poll runs in the deferred context,
+ * USB events are held off for one port at a time.
+ */
+
 void usb_cdc_poll() {
+    uint32_t perf_start = perf_probe_begin();
     for (int port = 0; port < (USB_CDC_NUM_PORTS); port++) {
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-        circ_buf_t *tx_buf = &cdc_state->tx_buf;
+        circ_buf_t *tx_buf = cdc_state->tx_buf;
+        size_t tx_buf_size = cdc_state->tx_buf_size;
+        usb_io_lock();
         if ((port != USB_CDC_CONFIG_PORT) || (usb_cdc_config_mode == 0)) {
             usb_cdc_sync_rx_buffer(port);
+            usb_cdc_update_port_rx_peak(port);
+        } else {
+            usb_cdc_config_mode_poll();
         }
         usb_cdc_notify_port_state_change(port);
         usb_cdc_port_send_rx_usb(port);
         if (cdc_state->line_state_change_ready) {
-            usb_cdc_set_line_coding(port, &cdc_state->line_coding, 0);
-            cdc_state->line_state_change_pending = 0;
-            cdc_state->line_state_change_ready = 0;
+            usb_cdc_port_apply_line_coding(port);
+            usb_cdc_port_start_tx(port);
         }
-        if (cdc_state->usb_rx_pending_ep) {
-            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
+        if (cdc_state->usb_rx_pending_ep && ((port != USB_CDC_CONFIG_PORT) || (usb_cdc_config_mode == 0))) {
+            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, tx_buf_size);
             size_t rx_bytes_available = usb_bytes_available(cdc_state->usb_rx_pending_ep);
             if (tx_space_available >= rx_bytes_available) {
-                usb_circ_buf_read(cdc_state->usb_rx_pending_ep, tx_buf, USB_CDC_BUF_SIZE);
+                usb_cdc_update_port_tx_peak(port, tx_space_available, rx_bytes_available);
+                event_trace_write(event_trace_usb_out_resume, port, rx_bytes_available);
+                usb_circ_buf_read_async(cdc_state->usb_rx_pending_ep, tx_buf, tx_buf_size);
                 usb_cdc_port_start_tx(port);
                 cdc_state->usb_rx_pending_ep = 0;
             }
         }
+        usb_io_unlock();
     }
+    perf_probe_end(perf_probe_usb_cdc_poll, perf_start);
 }
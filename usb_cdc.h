@@ -102,7 +102,9 @@ typedef uint16_t usb_cdc_serial_state_t;
 
 #define USB_CDC_SERIAL_STATE_DCD            0x01
 #define USB_CDC_SERIAL_STATE_DSR            0x02
+#define USB_CDC_SERIAL_STATE_BREAK          0x04
 #define USB_CDC_SERIAL_STATE_RI             0x08
+#define USB_CDC_SERIAL_STATE_FRAMING_ERROR  0x10
 #define USB_CDC_SERIAL_STATE_PARITY_ERROR   0x20
 #define USB_CDC_SERIAL_STATE_OVERRUN        0x40
 
@@ -169,6 +171,7 @@ void usb_cdc_interrupt_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event
 
 /* Device lifecycle functions */
 
+void usb_cdc_init();
 void usb_cdc_reset();
 void usb_cdc_enable();
 void usb_cdc_suspend();
@@ -199,10 +202,140 @@ void usb_cdc_reconfigure();
 /* CDC Device Definitions */
 
 #define USB_CDC_NUM_PORTS                       3
-#define USB_CDC_BUF_SIZE                        0x400
 #define USB_CDC_CRTL_LINES_POLLING_INTERVAL     20 /* ms */
+#define USB_CDC_RATE_INTERVAL                   250 /* ms */
+#define USB_CDC_RATE_EWMA_SHIFT                 2 /* Weight of a new rate sample is 1/4 */
 #define USB_CDC_CONFIG_PORT                     0
 
+/*
+ * Baud Rate
+ *
+ * The baud rate divider is rounded to the nearest value the USART can do,
+ * the actual baud rate is reported back to the host with GET_LINE_CODING.
+ * Rates with the error above USB_CDC_BAUD_RATE_TOLERANCE are rejected.
+ * The maximum rate is 4.5 MBaud for UART1 and 2.25 MBaud for UART2 and UART3.
+ */
+
+#ifndef USB_CDC_BAUD_RATE_TOLERANCE
+#define USB_CDC_BAUD_RATE_TOLERANCE             20 /* 1/1000 of the requested rate */
+#endif
+
+/* CDC Buffer Sizes */
+
+#define USB_CDC_BUF_SIZE                        0x400 /* Default */
+#define USB_CDC_BUF_SIZE_MIN                    0x80
+#define USB_CDC_CONFIG_PORT_BUF_SIZE_MIN        0x400 /* Config shell output */
+#define USB_CDC_BUF_ARENA_SIZE                  (USB_CDC_NUM_PORTS * 2 * USB_CDC_BUF_SIZE)
+
+int usb_cdc_buf_sizes_valid(const size_t *rx_buf_sizes, const size_t *tx_buf_sizes);
+
+/*
+ * CDC Buffer Pool
+ *
+ * With USB_CDC_BUF_POOL, received UART data are stored in blocks lent from
+ * a pool shared by all ports instead of fixed per-port RX buffers, so a port
+ * receiving a burst can use the memory of idle ports. The configured RX buffer
+ * size of each port is the minimum amount of memory reserved for the port.
+ */
+
+#ifndef USB_CDC_BUF_POOL
+#define USB_CDC_BUF_POOL                        0
+#endif
+
+#define USB_CDC_POOL_BLOCK_SIZE                 USB_CDC_BUF_SIZE_MIN
+
+/*
+ * TX DMA Extension
+ *
+ * With USB_CDC_TX_DMA_EXTEND, data received from the host while the UART TX DMA
+ * is running are appended to the running transfer instead of waiting for it to
+ * complete, so the TX DMA interrupt is raised only when the TX buffer wraps or drains.
+ */
+
+#ifndef USB_CDC_TX_DMA_EXTEND
+#define USB_CDC_TX_DMA_EXTEND                   0
+#endif
+
+/*
+ * Line Coding Barriers
+ *
+ * A line coding change is queued at the end of the TX data received before it,
+ * the host data that follow the change are received right away. The new line coding
+ * is applied once the UART has sent the last byte before the barrier. A change that
+ * does not fit in the queue replaces the line coding of the last barrier queued.
+ */
+
+#define USB_CDC_LINE_CODING_BARRIERS            4
+
+/*
+ * RX Capture
+ *
+ * With USB_CDC_RX_CAPTURE, the data received by a port in the capture mode are
+ * sent to the host as records, each one is a usb_cdc_rx_capture_header_t followed
+ * by the payload. The record timestamp is taken when the line goes idle after
+ * the received data or when the RX DMA fills a pool block. A record without a gap
+ * in the data is closed when it reaches the capture buffer size.
+ * The capture mode is not saved in the device configuration.
+ */
+
+#ifndef USB_CDC_RX_CAPTURE
+#define USB_CDC_RX_CAPTURE                      0
+#endif
+
+#define USB_CDC_RX_CAPTURE_BUF_SIZE             0x100
+#define USB_CDC_RX_CAPTURE_MARKS                8
+
+typedef struct {
+    uint32_t timestamp;         /* us, low 32 bits of the system time */
+    uint16_t size;
+} __attribute__ ((packed)) usb_cdc_rx_capture_header_t;
+
+void usb_cdc_set_port_rx_capture(int port, int enabled);
+int usb_cdc_get_port_rx_capture(int port);
+
+/*
+ * RX Error Marks
+ *
+ * With USB_CDC_RX_ERROR_MARKS, the bytes received with a parity or framing error
+ * by a port in the error marking mode are marked in the data sent to the host
+ * like with the PARMRK termios flag: a bad byte X is sent as 0xff 0x00 X, a break
+ * (a framing error on a zero byte) as 0xff 0x00 0x00, and a good 0xff byte as
+ * 0xff 0xff. Errors of up to USB_CDC_RX_ERROR_MARKS_DEPTH bytes not yet sent to
+ * the host are marked. The marking mode is not used in the capture mode and is
+ * not saved in the device configuration.
+ */
+
+#ifndef USB_CDC_RX_ERROR_MARKS
+#define USB_CDC_RX_ERROR_MARKS                  0
+#endif
+
+#define USB_CDC_RX_ERROR_MARKS_DEPTH            8
+#define USB_CDC_RX_ERROR_MARKS_BUF_SIZE         0x80
+
+void usb_cdc_set_port_rx_error_marks(int port, int enabled);
+int usb_cdc_get_port_rx_error_marks(int port);
+
+/* CDC Port Statistics */
+
+typedef struct {
+    uint32_t rx_bytes;          /* UART to USB */
+    uint32_t tx_bytes;          /* USB to UART */
+    uint32_t rx_rate;           /* bytes/s, moving average */
+    uint32_t tx_rate;           /* bytes/s, moving average */
+    uint32_t rx_overruns;
+    uint32_t rx_lost_bytes;     /* Overwritten before sent to the host, not with USB_CDC_BUF_POOL */
+    uint32_t parity_errors;
+    uint32_t framing_errors;
+    uint32_t noise_errors;
+    uint32_t usb_out_naks;      /* OUT packets held until the TX buffer has space */
+    uint32_t rx_peak;           /* bytes */
+    uint32_t tx_peak;           /* bytes */
+    uint32_t rx_blocks;         /* USB_CDC_BUF_POOL only */
+    uint32_t rx_blocks_peak;    /* USB_CDC_BUF_POOL only */
+} usb_cdc_port_stats_t;
+
+void usb_cdc_get_port_stats(int port, usb_cdc_port_stats_t *stats);
+
 /* CDC Polling */
 
 void usb_cdc_poll();
@@ -196,8 +196,6 @@ static struct {
         usb_control_state_idle,
         usb_control_state_rx,
         usb_control_state_tx,
-        usb_control_state_tx_zlp,
-        usb_control_state_tx_last,
         usb_control_state_status_in,
         usb_control_state_status_out,
     } state;
@@ -222,21 +220,8 @@ static void usb_control_endpoint_process_callback() {
 }
 
 static void usb_control_endpoint_process_tx(uint8_t ep_num) {
-    size_t bytes_sent = 0;
     switch (usb_control_ep_struct.state) {
     case usb_control_state_tx:
-    case usb_control_state_tx_zlp:
-        bytes_sent = usb_send(ep_num, usb_control_ep_struct.payload, usb_control_ep_struct.payload_size);
-        usb_control_ep_struct.payload = ((uint8_t*)usb_control_ep_struct.payload) + bytes_sent;
-        usb_control_ep_struct.payload_size -= bytes_sent;
-        if (usb_control_ep_struct.payload_size == 0) {
-            if ((usb_control_ep_struct.state == usb_control_state_tx) ||
-                (bytes_sent != usb_endpoints[ep_num].tx_size)) {
-                usb_control_ep_struct.state = usb_control_state_tx_last;
-            }
-        }
-        break;
-    case usb_control_state_tx_last:
         usb_control_ep_struct.state = usb_control_state_status_out;
         break;
     case usb_control_state_status_in:
@@ -298,15 +283,13 @@ static void usb_control_endpoint_process_rx(uint8_t ep_num) {
                                                  &usb_control_ep_struct.tx_complete_callback)) {                              
     case usb_status_ack:
         if (usb_control_ep_struct.setup->direction == usb_setup_direction_device_to_host) {
-            if (usb_control_ep_struct.payload_size < usb_control_ep_struct.setup->wLength) {
-                usb_control_ep_struct.state = usb_control_state_tx_zlp;
-            } else {
-                if (usb_control_ep_struct.payload_size > usb_control_ep_struct.setup->wLength) {
-                    usb_control_ep_struct.payload_size = usb_control_ep_struct.setup->wLength;
-                }
-                usb_control_ep_struct.state = usb_control_state_tx;
+            /* A short data stage must be terminated with a ZLP if it ends with a full packet */
+            int zlp = (usb_control_ep_struct.payload_size < usb_control_ep_struct.setup->wLength);
+            if (usb_control_ep_struct.payload_size > usb_control_ep_struct.setup->wLength) {
+                usb_control_ep_struct.payload_size = usb_control_ep_struct.setup->wLength;
             }
-            usb_control_endpoint_process_tx(ep_num);
+            usb_control_ep_struct.state = usb_control_state_tx;
+            usb_transfer_send(ep_num, usb_control_ep_struct.payload, usb_control_ep_struct.payload_size, zlp);
             return;
         } else {
             usb_send(ep_num, 0, 0);
@@ -325,6 +308,7 @@ void usb_control_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event_t ep_
     if (ep_num == usb_endpoint_address_control) {
         if (ep_event == usb_endpoint_event_setup || ep_event == usb_endpoint_event_data_received) {
             if (ep_event == usb_endpoint_event_setup) {
+                usb_transfer_cancel(ep_num);
                 usb_control_ep_struct.state = usb_control_state_idle;
             }
             usb_control_endpoint_process_rx(ep_num);
@@ -339,5 +323,6 @@ void usb_control_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event_t ep_
 }
 
 void usb_init() {
+    usb_cdc_init();
     usb_io_init();
 }
@@ -20,6 +20,27 @@
 
 #define USB_CDC_INTERRUPT_ENDPOINT_POLLING_INTERVAL 20
 
+/*
+ * Packet memory budget, same layout as usb_io_reset() allocates: the buffer
+ * table (four 16-bit words per endpoint), the control endpoint buffers,
+ * then for each port the notification buffer and two data packets,
+ * one more data packet if the port data IN endpoint is double-buffered.
+ */
+
+#define USB_PMA_BTABLE_SIZE                 (8 * (1 + 2 * USB_CDC_NUM_PORTS))
+#define USB_PMA_CDC_PORT_SIZE(n)            (USB_CDC_INTERRUPT_ENDPOINT_SIZE + \
+                                             (2 + USB_CDC_DATA_##n##_ENDPOINT_DBL_BUF) * USB_CDC_DATA_##n##_ENDPOINT_SIZE)
+
+#if (USB_PMA_BTABLE_SIZE + 2 * USB_CONTROL_ENDPOINT_SIZE + \
+     USB_PMA_CDC_PORT_SIZE(0) + USB_PMA_CDC_PORT_SIZE(1) + USB_PMA_CDC_PORT_SIZE(2)) > USB_PMA_SIZE
+#error "Endpoint buffers do not fit in the USB packet memory, check USB_CDC_DATA_n_ENDPOINT_DBL_BUF"
+#endif
+
+/*
+ * Notification endpoints sharing their endpoint register with a data OUT endpoint
+ * are set up as bulk, the USB peripheral handles bulk and interrupt transfers the same way.
+ */
+
 const usb_endpoint_t usb_endpoints[usb_endpoint_address_last] = {
     /*  Default Control Endpoint */
     {
@@ -28,46 +49,49 @@ const usb_endpoint_t usb_endpoints[usb_endpoint_address_last] = {
         .tx_size    = USB_CONTROL_ENDPOINT_SIZE,
         .event_handler = usb_control_endpoint_event_handler,
     },
-    /*  CDC 0 Interrupt Endpoint */
+    /*  CDC 0 Interrupt Endpoint (and Data OUT Endpoint if Data IN is double-buffered) */
     { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
+        .type       = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ? usb_endpoint_type_bulk : usb_endpoint_type_interrupt,
+        .rx_size    = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ? USB_CDC_DATA_0_ENDPOINT_SIZE : 0,
         .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
+        .event_handler = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ? usb_cdc_data_endpoint_event_handler : 0,
     },
      /*  CDC 0 Data Endpoint */
     { 
         .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_0_ENDPOINT_SIZE,
+        .rx_size    = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ? 0 : USB_CDC_DATA_0_ENDPOINT_SIZE,
         .tx_size    = USB_CDC_DATA_0_ENDPOINT_SIZE,
+        .buffering  = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ? usb_endpoint_buffer_dbl_tx : usb_endpoint_buffer_single,
         .event_handler = usb_cdc_data_endpoint_event_handler,
     },
-    /*  CDC 1 Interrupt Endpoint */
+    /*  CDC 1 Interrupt Endpoint (and Data OUT Endpoint if Data IN is double-buffered) */
     { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
+        .type       = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ? usb_endpoint_type_bulk : usb_endpoint_type_interrupt,
+        .rx_size    = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ? USB_CDC_DATA_1_ENDPOINT_SIZE : 0,
         .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
+        .event_handler = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ? usb_cdc_data_endpoint_event_handler : 0,
     },
      /*  CDC 1 Data Endpoint */
     { 
         .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_1_ENDPOINT_SIZE,
+        .rx_size    = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ? 0 : USB_CDC_DATA_1_ENDPOINT_SIZE,
         .tx_size    = USB_CDC_DATA_1_ENDPOINT_SIZE,
+        .buffering  = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ? usb_endpoint_buffer_dbl_tx : usb_endpoint_buffer_single,
         .event_handler = usb_cdc_data_endpoint_event_handler,
     },
-    /*  CDC 2 Interrupt Endpoint */
+    /*  CDC 2 Interrupt Endpoint (and Data OUT Endpoint if Data IN is double-buffered) */
     { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
+        .type       = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ? usb_endpoint_type_bulk : usb_endpoint_type_interrupt,
+        .rx_size    = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ? USB_CDC_DATA_2_ENDPOINT_SIZE : 0,
         .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
+        .event_handler = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ? usb_cdc_data_endpoint_event_handler : 0,
     },
      /*  CDC 2 Data Endpoint */
     { 
         .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_2_ENDPOINT_SIZE,
+        .rx_size    = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ? 0 : USB_CDC_DATA_2_ENDPOINT_SIZE,
         .tx_size    = USB_CDC_DATA_2_ENDPOINT_SIZE,
+        .buffering  = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ? usb_endpoint_buffer_dbl_tx : usb_endpoint_buffer_single,
         .event_handler = usb_cdc_data_endpoint_event_handler,
     },
 };
@@ -187,7 +211,7 @@ const usb_device_configuration_descriptor_t usb_configuration_descriptor = {
     .data_eprx_0 = {
         .bLength                = sizeof(usb_configuration_descriptor.data_eprx_0),
         .bDescriptorType        = usb_descriptor_type_endpoint,
-        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_0_data,
+        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_0_data_out,
         .bmAttributes           = usb_endpoint_type_bulk,
         .wMaxPacketSize         = USB_CDC_DATA_0_ENDPOINT_SIZE,
         .bInterval              = 0,
@@ -269,7 +293,7 @@ const usb_device_configuration_descriptor_t usb_configuration_descriptor = {
     .data_eprx_1 = {
         .bLength                = sizeof(usb_configuration_descriptor.data_eprx_1),
         .bDescriptorType        = usb_descriptor_type_endpoint,
-        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_1_data,
+        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_1_data_out,
         .bmAttributes           = usb_endpoint_type_bulk,
         .wMaxPacketSize         = USB_CDC_DATA_1_ENDPOINT_SIZE,
         .bInterval              = 0,
@@ -351,7 +375,7 @@ const usb_device_configuration_descriptor_t usb_configuration_descriptor = {
     .data_eprx_2 = {
         .bLength                = sizeof(usb_configuration_descriptor.data_eprx_2),
         .bDescriptorType        = usb_descriptor_type_endpoint,
-        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_2_data,
+        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_2_data_out,
         .bmAttributes           = usb_endpoint_type_bulk,
         .wMaxPacketSize         = USB_CDC_DATA_2_ENDPOINT_SIZE,
         .bInterval              = 0,
@@ -46,6 +46,40 @@ enum {
     usb_endpoint_address_last
 };
 
+/*
+ * Double-Buffered CDC Data Endpoints
+ *
+ * A double-buffered bulk endpoint is unidirectional. When enabled for a port,
+ * the data IN endpoint keeps its address and the data OUT endpoint moves
+ * to the endpoint register of the port notification endpoint.
+ * Each enabled port takes one more data packet of the packet memory.
+ *
+ * The packet memory only has room for one more 32-byte packet, so only
+ * port 0 (32-byte data packets) can be double-buffered. Ports 1 and 2 use
+ * 64-byte data packets, enabling the option for them fails the build.
+ */
+
+#ifndef USB_CDC_DATA_0_ENDPOINT_DBL_BUF
+#define USB_CDC_DATA_0_ENDPOINT_DBL_BUF     0
+#endif
+
+#ifndef USB_CDC_DATA_1_ENDPOINT_DBL_BUF
+#define USB_CDC_DATA_1_ENDPOINT_DBL_BUF     0
+#endif
+
+#ifndef USB_CDC_DATA_2_ENDPOINT_DBL_BUF
+#define USB_CDC_DATA_2_ENDPOINT_DBL_BUF     0
+#endif
+
+enum {
+    usb_endpoint_address_cdc_0_data_out = USB_CDC_DATA_0_ENDPOINT_DBL_BUF ?
+                                          usb_endpoint_address_cdc_0_interrupt : usb_endpoint_address_cdc_0_data,
+    usb_endpoint_address_cdc_1_data_out = USB_CDC_DATA_1_ENDPOINT_DBL_BUF ?
+                                          usb_endpoint_address_cdc_1_interrupt : usb_endpoint_address_cdc_1_data,
+    usb_endpoint_address_cdc_2_data_out = USB_CDC_DATA_2_ENDPOINT_DBL_BUF ?
+                                          usb_endpoint_address_cdc_2_interrupt : usb_endpoint_address_cdc_2_data,
+};
+
 extern const usb_endpoint_t usb_endpoints[usb_endpoint_address_last];
 
 /* Interfaces */
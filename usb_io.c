@@ -6,33 +6,239 @@
 
 #include <stm32f1xx.h>
 #include "system_interrupts.h"
+#include "system_time.h"
 #include "status_led.h"
 #include "usb_descriptors.h"
 #include "usb_core.h"
 #include "usb_panic.h"
 #include "usb_io.h"
+#include "trace.h"
+#include "perf.h"
+#include "event_trace.h"
 
 static volatile usb_btable_entity_t *usb_btable = (usb_btable_entity_t*)USB_PMAADDR;
 
+/* Packet Buffers */
+
+static volatile usb_btable_buffer_t *usb_btable_buffer(uint8_t ep_num, int buf_num) {
+    return ((volatile usb_btable_buffer_t*)&usb_btable[ep_num]) + buf_num;
+}
+
+static usb_pbuffer_data_t *usb_pbuffer(volatile usb_btable_buffer_t *btable_buffer) {
+    return (usb_pbuffer_data_t *)(USB_PMAADDR + (btable_buffer->offset<<1));
+}
+
+static pb_word_t usb_btable_rx_count(size_t rx_size) {
+    if (rx_size > USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT) {
+        return (((rx_size / USB_BTABLE_LARGE_BLOCK_SIZE) - 1) << USB_COUNT0_RX_NUM_BLOCK_Pos) | USB_COUNT0_RX_BLSIZE;
+    }
+    return (rx_size / USB_BTABLE_SMALL_BLOCK_SIZE) << USB_COUNT0_RX_NUM_BLOCK_Pos;
+}
+
+/*
+ * Double-buffered endpoints: the USB peripheral uses the buffer pointed by DTOG,
+ * the application owns the buffer pointed by SW_BUF and hands it over by toggling SW_BUF.
+ * A filled IN buffer can only be handed over when the peripheral has nothing
+ * left to send, otherwise it is marked pending and handed over on CTR_TX.
+ */
+
+static uint8_t usb_dbl_buf_tx_pending = 0;
+
+/*
+ * CTR_TX in the high priority interrupt and DMA completion may preempt the pending flag
+ * and transfer updates. The lock nests, preempting contexts always release it in order.
+ */
+
+#if USB_IRQ_HP_CTR || USB_PMA_DMA
+static uint8_t usb_dbl_buf_lock_depth = 0;
+#endif
+
+static void usb_dbl_buf_lock() {
+#if USB_IRQ_HP_CTR
+    NVIC_DisableIRQ(USB_HP_CAN1_TX_IRQn);
+#endif
+#if USB_PMA_DMA
+    NVIC_DisableIRQ(DMA1_Channel1_IRQn);
+#endif
+#if USB_IRQ_HP_CTR || USB_PMA_DMA
+    usb_dbl_buf_lock_depth++;
+#endif
+}
+
+static void usb_dbl_buf_unlock() {
+#if USB_IRQ_HP_CTR || USB_PMA_DMA
+    if (--usb_dbl_buf_lock_depth) {
+        return;
+    }
+#endif
+#if USB_PMA_DMA
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+#endif
+#if USB_IRQ_HP_CTR
+    NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
+#endif
+}
+
+static void usb_dbl_buf_toggle_sw_buf(uint8_t ep_num, ep_reg_t sw_buf) {
+    ep_reg_t *ep_reg = ep_regs(ep_num);
+    *ep_reg = (*ep_reg & USB_EPREG_MASK) | sw_buf | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+}
+
+static void usb_dbl_buf_tx_release(uint8_t ep_num) {
+    if (usb_dbl_buf_tx_pending & (1 << ep_num)) {
+        usb_dbl_buf_tx_pending &= ~(1 << ep_num);
+        usb_dbl_buf_toggle_sw_buf(ep_num, USB_EP_TX_SW_BUF);
+    }
+}
+
+/* Buffer to be filled with the next IN packet */
+static volatile usb_btable_buffer_t *usb_tx_buffer(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_tx) {
+        return usb_btable_buffer(ep_num, !!(*ep_regs(ep_num) & USB_EP_TX_SW_BUF));
+    }
+    return usb_btable_buffer(ep_num, 0);
+}
+
+/* Buffer holding the last received OUT packet */
+static volatile usb_btable_buffer_t *usb_rx_buffer(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_rx) {
+        return usb_btable_buffer(ep_num, !(*ep_regs(ep_num) & USB_EP_RX_SW_BUF));
+    }
+    return usb_btable_buffer(ep_num, 1);
+}
+
+static void usb_trace_packet(trace_record_type_t type, uint8_t ep_num,
+                             volatile usb_btable_buffer_t *btable_buffer, size_t count);
+
+static void usb_tx_commit(uint8_t ep_num, volatile usb_btable_buffer_t *tx_buffer, size_t count) {
+    ep_reg_t *ep_reg = ep_regs(ep_num);
+    tx_buffer->count = count;
+    usb_trace_packet(trace_record_in, ep_num, tx_buffer, count);
+    if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_tx) {
+        usb_dbl_buf_lock();
+        ep_reg_t ep_reg_value = *ep_reg;
+        if (!(ep_reg_value & USB_EP_DTOG_TX) == !(ep_reg_value & USB_EP_TX_SW_BUF)) {
+            usb_dbl_buf_toggle_sw_buf(ep_num, USB_EP_TX_SW_BUF);
+        } else {
+            usb_dbl_buf_tx_pending |= (1 << ep_num);
+        }
+        usb_dbl_buf_unlock();
+    } else {
+        *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    }
+}
+
+static void usb_rx_release(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_rx) {
+        usb_dbl_buf_toggle_sw_buf(ep_num, USB_EP_RX_SW_BUF);
+    } else {
+        ep_reg_t *ep_reg = ep_regs(ep_num);
+        *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    }
+}
+
+/* Packet Memory DMA State */
+
+#if USB_PMA_DMA
+
+typedef struct {
+    uint8_t                         busy;
+    uint8_t                         ep_num;
+    uint8_t                         send;
+    circ_buf_t                      *buf;
+    size_t                          buf_size;
+    size_t                          count;
+    volatile usb_btable_buffer_t    *pbuffer;
+    uint8_t                         *wrap_span;
+    usb_pbuffer_data_t              *wrap_ep_buf;
+    size_t                          wrap_words_count;
+} usb_pma_dma_t;
+
+static usb_pma_dma_t usb_pma_dma;
+
+/* Endpoints with a completed read, reported by usb_handle_events */
+static uint8_t usb_pma_dma_read_events = 0;
+
+/* Endpoints with a queued transfer to refill after a completed write, see usb_handle_events */
+static uint8_t usb_pma_dma_write_events = 0;
+
+#endif
+
+/* Queued IN Transfer State */
+
+typedef struct {
+    const uint8_t   *span;
+    size_t          span_size;
+    const uint8_t   *wrap_span;
+    size_t          wrap_span_size;
+    size_t          size;
+    size_t          sent;
+    uint8_t         active;
+    uint8_t         zlp;
+    uint8_t         last_queued;
+    uint8_t         packets_in_flight;
+} usb_transfer_t;
+
+static usb_transfer_t usb_transfers[USB_MAX_ENDPOINTS];
+
+/* Endpoint buffer is owned by a DMA transfer in progress */
+static int usb_pma_dma_pending(uint8_t ep_num) {
+#if USB_PMA_DMA
+    return usb_pma_dma.busy && (usb_pma_dma.ep_num == ep_num);
+#else
+    return 0;
+#endif
+}
+
 /* USB Initialization After Reset */
 
 void usb_io_reset() {
     uint16_t offset = USB_BTABLE_SIZE;
+    usb_dbl_buf_tx_pending = 0;
+    for (uint8_t ep_num=0; ep_num<USB_MAX_ENDPOINTS; ep_num++) {
+        usb_transfers[ep_num].active = 0;
+    }
+#if USB_PMA_DMA
+    DMA1_Channel1->CCR &= ~(DMA_CCR_EN);
+    usb_pma_dma.busy = 0;
+    usb_pma_dma_read_events = 0;
+    usb_pma_dma_write_events = 0;
+#endif
     for (uint8_t ep_num=0; ep_num<USB_NUM_ENDPOINTS; ep_num++) {
         ep_reg_t ep_type = 0;
+        ep_reg_t ep_state = 0;
         ep_reg_t *ep_reg = ep_regs(ep_num);
-        usb_btable[ep_num].tx_offset = offset;
-        usb_btable[ep_num].tx_count = 0;
-        offset += usb_endpoints[ep_num].tx_size;
-        usb_btable[ep_num].rx_offset = offset;
-        if (usb_endpoints[ep_num].rx_size > USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT) {
-            usb_btable[ep_num].rx_count = ((usb_endpoints[ep_num].rx_size / USB_BTABLE_LARGE_BLOCK_SIZE) - 1) << USB_COUNT0_RX_NUM_BLOCK_Pos;
-            usb_btable[ep_num].rx_count |= USB_COUNT0_RX_BLSIZE;
-        } else {
-            usb_btable[ep_num].rx_count = (usb_endpoints[ep_num].rx_size / USB_BTABLE_SMALL_BLOCK_SIZE) << USB_COUNT0_RX_NUM_BLOCK_Pos;
+        const usb_endpoint_t *ep = &usb_endpoints[ep_num];
+        switch (ep->buffering) {
+        case usb_endpoint_buffer_dbl_tx:
+            for (int buf_num = 0; buf_num < 2; buf_num++) {
+                usb_btable_buffer(ep_num, buf_num)->offset = offset;
+                usb_btable_buffer(ep_num, buf_num)->count = 0;
+                offset += ep->tx_size;
+            }
+            /* SW_BUF == DTOG_TX, the peripheral NAKs until the first buffer is handed over */
+            ep_state = USB_EP_KIND | USB_EP_RX_DIS | USB_EP_TX_VALID;
+            break;
+        case usb_endpoint_buffer_dbl_rx:
+            for (int buf_num = 0; buf_num < 2; buf_num++) {
+                usb_btable_buffer(ep_num, buf_num)->offset = offset;
+                usb_btable_buffer(ep_num, buf_num)->count = usb_btable_rx_count(ep->rx_size);
+                offset += ep->rx_size;
+            }
+            /* SW_BUF != DTOG_RX, the peripheral can receive into buffer 0 right away */
+            ep_state = USB_EP_KIND | USB_EP_RX_VALID | USB_EP_TX_DIS | USB_EP_RX_SW_BUF;
+            break;
+        default:
+            usb_btable[ep_num].tx_offset = offset;
+            usb_btable[ep_num].tx_count = 0;
+            offset += ep->tx_size;
+            usb_btable[ep_num].rx_offset = offset;
+            usb_btable[ep_num].rx_count = usb_btable_rx_count(ep->rx_size);
+            offset += ep->rx_size;
+            ep_state = USB_EP_RX_VALID | USB_EP_TX_NAK;
+            break;
         }
-        offset += usb_endpoints[ep_num].rx_size;
-        switch(usb_endpoints[ep_num].type) {
+        switch(ep->type) {
         case usb_endpoint_type_control:
             ep_type = USB_EP_CONTROL;
             break;
@@ -46,7 +252,10 @@ void usb_io_reset() {
             ep_type = USB_EP_INTERRUPT;
             break;
         }
-        *ep_reg = USB_EP_RX_VALID | USB_EP_TX_NAK | ep_type | ep_num;
+        *ep_reg = ep_state | ep_type | ep_num;
+    }
+    if (offset > USB_PMA_SIZE) {
+        usb_panic();
     }
     USB->CNTR = USB_CNTR_CTRM | USB_CNTR_RESETM | USB_CNTR_SUSPM | USB_CNTR_WKUPM | USB_CNTR_SOFM;
     USB->DADDR = USB_DADDR_EF;
@@ -73,62 +282,119 @@ void usb_io_init() {
     USB->DADDR = 0;
     USB->ISTR = 0;
     USB->CNTR = USB_CNTR_RESETM;
+#if USB_PMA_DMA
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    NVIC_SetPriority(DMA1_Channel1_IRQn, SYSTEM_INTERRUTPS_PRIORITY_BASE);
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+#endif
+#if USB_IRQ_DRIVEN
+    NVIC_SetPriority(PendSV_IRQn, SYSTEM_INTERRUTPS_PRIORITY_LOW);
+    NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, SYSTEM_INTERRUTPS_PRIORITY_BASE);
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
+#if USB_IRQ_HP_CTR
+    NVIC_SetPriority(USB_HP_CAN1_TX_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
+#endif
+}
+
+/* Deferred Context */
+
+void usb_io_lock() {
+#if USB_IRQ_DRIVEN
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
+#if USB_IRQ_HP_CTR
+    /* Class handlers of double-buffered endpoints run in the high priority interrupt */
+    usb_dbl_buf_lock();
+#endif
+}
+
+void usb_io_unlock() {
+#if USB_IRQ_HP_CTR
+    usb_dbl_buf_unlock();
+#endif
+#if USB_IRQ_DRIVEN
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
+}
+
+void usb_poll_request() {
+#if USB_IRQ_DRIVEN
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+#endif
 }
 
 /* Get Number of RX/TX Bytes Available  */
 size_t usb_bytes_available(uint8_t ep_num) {
-    return usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
+    return usb_rx_buffer(ep_num)->count & USB_COUNT0_RX_COUNT0_RX;
 }
 
 size_t usb_space_available(uint8_t ep_num) {
     ep_reg_t *ep_reg = ep_regs(ep_num);
     size_t tx_space_available = 0;
-    if ((*ep_reg & USB_EPTX_STAT) == USB_EP_TX_NAK) {
+    if (usb_pma_dma_pending(ep_num)) {
+        tx_space_available = 0;
+    } else if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_tx) {
+        if (((*ep_reg & USB_EPTX_STAT) == USB_EP_TX_VALID) && !(usb_dbl_buf_tx_pending & (1 << ep_num))) {
+            tx_space_available = usb_endpoints[ep_num].tx_size;
+        }
+    } else if ((*ep_reg & USB_EPTX_STAT) == USB_EP_TX_NAK) {
         tx_space_available = usb_endpoints[ep_num].tx_size;
     }
     return tx_space_available;
 }
 
+/* Packet Memory Copy */
+
+static void usb_pbuffer_write_spans(usb_pbuffer_data_t *ep_buf, const uint8_t *span, size_t span_size,
+                                    const uint8_t *wrap_span, size_t wrap_span_size) {
+    uint32_t perf_start = perf_probe_begin();
+    usb_pbuffer_copy_from_spans(ep_buf, span, span_size, wrap_span, wrap_span_size);
+    perf_probe_end(perf_probe_pma_write, perf_start);
+}
+
+static void usb_pbuffer_read_spans(usb_pbuffer_data_t *ep_buf, uint8_t *span, size_t span_size,
+                                   uint8_t *wrap_span, size_t wrap_span_size) {
+    uint32_t perf_start = perf_probe_begin();
+    usb_pbuffer_copy_to_spans(ep_buf, span, span_size, wrap_span, wrap_span_size);
+    perf_probe_end(perf_probe_pma_read, perf_start);
+}
+
+/* Traffic Trace */
+
+static void usb_trace_packet(trace_record_type_t type, uint8_t ep_num,
+                             volatile usb_btable_buffer_t *btable_buffer, size_t count) {
+#if TRACE_RECORDER
+    uint8_t *payload = trace_record_alloc(type, ep_num, count);
+    if (payload) {
+        usb_pbuffer_read_spans(usb_pbuffer(btable_buffer), payload, count, 0, 0);
+    }
+#endif
+}
+
 /* Endpoint Read/Write Operations */
 
 int usb_read(uint8_t ep_num, void *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1));
-    pb_word_t ep_bytes_count = usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
-    pb_word_t words_left = ep_bytes_count>>1;
-    pb_word_t *buf_p = (pb_word_t*)buf;
+    volatile usb_btable_buffer_t *rx_buffer = usb_rx_buffer(ep_num);
+    pb_word_t ep_bytes_count = rx_buffer->count & USB_COUNT0_RX_COUNT0_RX;
     if (ep_bytes_count > buf_size) {
         return -1;
     }
-    usb_btable[ep_num].rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
-    while(words_left--) {
-         *buf_p++ = (ep_buf++)->data;
-    }
-    if (ep_bytes_count & 0x01) {
-        *((uint8_t*)buf_p) = (uint8_t)ep_buf->data;
-    }
-    *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    rx_buffer->count &= ~USB_COUNT0_RX_COUNT0_RX;
+    usb_pbuffer_read_spans(usb_pbuffer(rx_buffer), buf, ep_bytes_count, 0, 0);
+    usb_rx_release(ep_num);
     return ep_bytes_count;
 }
 
 size_t usb_send(uint8_t ep_num, const void *buf, size_t count) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1));
-    pb_word_t *buf_p = (pb_word_t*)buf;
-    pb_word_t words_left;
+    volatile usb_btable_buffer_t *tx_buffer = usb_tx_buffer(ep_num);
     size_t tx_space_available = usb_endpoints[ep_num].tx_size;
     if (count > tx_space_available) {
         count = tx_space_available;
     }
-    words_left = count >> 1;
-    while (words_left--) {
-        (ep_buf++)->data = *buf_p++;
-    }
-    if (count & 0x01) {
-        (ep_buf)->data = (uint8_t)*buf_p;
-    }
-    usb_btable[ep_num].tx_count = count;
-    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    usb_pbuffer_write_spans(usb_pbuffer(tx_buffer), buf, count, 0, 0);
+    usb_tx_commit(ep_num, tx_buffer, count);
     return count;
 }
 
@@ -137,52 +403,292 @@ size_t usb_send(uint8_t ep_num, const void *buf, size_t count) {
 
 /* NOTE: usb_circ_buf_read assumes enough buffer space is available */
 size_t usb_circ_buf_read(uint8_t ep_num, circ_buf_t *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1));
-    pb_word_t ep_bytes_count = usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
-    size_t words_left = ep_bytes_count>>1;
-    usb_btable[ep_num].rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
-    while(words_left--) {
-        buf->data[buf->head] = (uint8_t)(ep_buf->data);
-        buf->head = (buf->head + 1) & (buf_size - 1);
-        buf->data[buf->head] = (uint8_t)(((ep_buf++)->data) >> 8);
-        buf->head = (buf->head + 1) & (buf_size - 1);
-    }
-    if (ep_bytes_count & 0x1) {
-        buf->data[buf->head] = (uint8_t)(ep_buf->data);
-        buf->head = (buf->head + 1) & (buf_size - 1);
-    }
-    *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    volatile usb_btable_buffer_t *rx_buffer = usb_rx_buffer(ep_num);
+    pb_word_t ep_bytes_count = rx_buffer->count & USB_COUNT0_RX_COUNT0_RX;
+    size_t span_size = buf_size - buf->head;
+    if (span_size > ep_bytes_count) {
+        span_size = ep_bytes_count;
+    }
+    rx_buffer->count &= ~USB_COUNT0_RX_COUNT0_RX;
+    usb_pbuffer_read_spans(usb_pbuffer(rx_buffer), &buf->data[buf->head], span_size,
+                           buf->data, ep_bytes_count - span_size);
+    buf->head = (buf->head + ep_bytes_count) & (buf_size - 1);
+    usb_rx_release(ep_num);
     return ep_bytes_count;
 }
 
 /* NOTE: usb_circ_buf_send assumes endpoint is ready to send */
 size_t usb_circ_buf_send(uint8_t ep_num, circ_buf_t *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1));
+    volatile usb_btable_buffer_t *tx_buffer = usb_tx_buffer(ep_num);
     size_t count = circ_buf_count(buf->head, buf->tail, buf_size);
+    size_t span_size = circ_buf_count_to_end(buf->head, buf->tail, buf_size);
     size_t tx_space_available = usb_endpoints[ep_num].tx_size;
-    size_t words_left;
     if (count > tx_space_available) {
         count = tx_space_available;
     }
-    words_left = count >> 1;
-    while (words_left--) {
-        pb_word_t pb_word = buf->data[buf->tail];
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
-        pb_word |= ((uint16_t)buf->data[buf->tail]) << 8;
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
-        (ep_buf++)->data = pb_word;
-    }
-    if (count & 0x1) {
-        (ep_buf)->data = buf->data[buf->tail];
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
+    if (span_size > count) {
+        span_size = count;
     }
-    usb_btable[ep_num].tx_count = count;
-    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    usb_pbuffer_write_spans(usb_pbuffer(tx_buffer), &buf->data[buf->tail], span_size,
+                            buf->data, count - span_size);
+    buf->tail = (buf->tail + count) & (buf_size - 1);
+    usb_tx_commit(ep_num, tx_buffer, count);
     return count;
 }
 
+/* Packet Memory DMA Engine */
+
+/*
+ * DMA1 Channel 1 runs memory-to-memory: 16-bit accesses on the SRAM side,
+ * 32-bit accesses on the packet memory side to match its stride.
+ * One transfer is in flight at a time, a ring wrap takes a second DMA run.
+ * An odd trailing byte is copied by the CPU when the transfer starts.
+ * The DMA cannot split a packet memory word between two ring spans,
+ * such transfers and transfers starting at an odd address are left to the CPU.
+ */
+
+#if USB_PMA_DMA
+
+static void usb_pma_dma_start(usb_pbuffer_data_t *ep_buf, uint8_t *data, size_t words_count) {
+    DMA1_Channel1->CCR &= ~(DMA_CCR_EN);
+    DMA1_Channel1->CPAR = (uint32_t)ep_buf;
+    DMA1_Channel1->CMAR = (uint32_t)data;
+    DMA1_Channel1->CNDTR = words_count;
+    DMA1_Channel1->CCR = DMA_CCR_MEM2MEM | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_1 | DMA_CCR_MINC | DMA_CCR_PINC |
+                         DMA_CCR_TCIE | (usb_pma_dma.send ? DMA_CCR_DIR : 0) | DMA_CCR_EN;
+}
+
+/* buf is the ring to advance on completion, if any */
+static int usb_pma_dma_submit(uint8_t ep_num, int send, volatile usb_btable_buffer_t *pbuffer,
+                              uint8_t *span, size_t span_size, uint8_t *wrap_span, size_t wrap_span_size,
+                              circ_buf_t *buf, size_t buf_size) {
+    size_t count = span_size + wrap_span_size;
+    if (usb_pma_dma.busy || (count < 2) || ((uintptr_t)span & 0x01) ||
+        (wrap_span_size && ((span_size & 0x01) || ((uintptr_t)wrap_span & 0x01)))) {
+        return 0;
+    }
+    usb_pbuffer_data_t *ep_buf = usb_pbuffer(pbuffer);
+    if (count & 0x01) {
+        uint8_t *last = wrap_span_size ? &wrap_span[wrap_span_size - 1] : &span[span_size - 1];
+        if (send) {
+            ep_buf[count >> 1].data = *last;
+        } else {
+            *last = (uint8_t)ep_buf[count >> 1].data;
+        }
+    }
+    usb_pma_dma.busy = 1;
+    usb_pma_dma.ep_num = ep_num;
+    usb_pma_dma.send = send;
+    usb_pma_dma.buf = buf;
+    usb_pma_dma.buf_size = buf_size;
+    usb_pma_dma.count = count;
+    usb_pma_dma.pbuffer = pbuffer;
+    usb_pma_dma.wrap_span = wrap_span;
+    usb_pma_dma.wrap_ep_buf = ep_buf + (span_size >> 1);
+    usb_pma_dma.wrap_words_count = wrap_span_size >> 1;
+    usb_pma_dma_start(ep_buf, span, span_size >> 1);
+    return 1;
+}
+
+static void usb_pma_dma_complete() {
+    uint8_t ep_num = usb_pma_dma.ep_num;
+    circ_buf_t *buf = usb_pma_dma.buf;
+    if (usb_pma_dma.send) {
+        if (buf) {
+            buf->tail = (buf->tail + usb_pma_dma.count) & (usb_pma_dma.buf_size - 1);
+        }
+        usb_tx_commit(ep_num, usb_pma_dma.pbuffer, usb_pma_dma.count);
+        usb_pma_dma.busy = 0;
+        if (usb_transfers[ep_num].active) {
+            /* The other buffer of a double-buffered endpoint may be free now */
+            __sync_fetch_and_or(&usb_pma_dma_write_events, (1 << ep_num));
+#if USB_IRQ_DRIVEN
+            NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
+        }
+    } else {
+        if (buf) {
+            buf->head = (buf->head + usb_pma_dma.count) & (usb_pma_dma.buf_size - 1);
+        }
+        usb_rx_release(ep_num);
+        usb_pma_dma.busy = 0;
+        __sync_fetch_and_or(&usb_pma_dma_read_events, (1 << ep_num));
+#if USB_IRQ_DRIVEN
+        NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
+    }
+}
+
+void DMA1_Channel1_IRQHandler() {
+    (void)DMA1_Channel1_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF1 );
+    DMA1->IFCR = status;
+    if (status && usb_pma_dma.busy) {
+        if (usb_pma_dma.wrap_words_count) {
+            usb_pma_dma_start(usb_pma_dma.wrap_ep_buf, usb_pma_dma.wrap_span, usb_pma_dma.wrap_words_count);
+            usb_pma_dma.wrap_words_count = 0;
+        } else {
+            DMA1_Channel1->CCR &= ~(DMA_CCR_EN);
+            usb_pma_dma_complete();
+        }
+    }
+    perf_probe_end(perf_probe_dma1_ch1, perf_start);
+}
+
+#endif
+
+size_t usb_circ_buf_read_async(uint8_t ep_num, circ_buf_t *buf, size_t buf_size) {
+#if USB_PMA_DMA
+    volatile usb_btable_buffer_t *rx_buffer = usb_rx_buffer(ep_num);
+    pb_word_t ep_bytes_count = rx_buffer->count & USB_COUNT0_RX_COUNT0_RX;
+    size_t span_size = buf_size - buf->head;
+    if (span_size > ep_bytes_count) {
+        span_size = ep_bytes_count;
+    }
+    if (usb_pma_dma_submit(ep_num, 0, rx_buffer, &buf->data[buf->head], span_size,
+                           buf->data, ep_bytes_count - span_size, buf, buf_size)) {
+        rx_buffer->count &= ~USB_COUNT0_RX_COUNT0_RX;
+        return ep_bytes_count;
+    }
+#endif
+    return usb_circ_buf_read(ep_num, buf, buf_size);
+}
+
+size_t usb_circ_buf_read_pending(circ_buf_t *buf) {
+#if USB_PMA_DMA
+    if (usb_pma_dma.busy && !usb_pma_dma.send && (usb_pma_dma.buf == buf)) {
+        return usb_pma_dma.count;
+    }
+#endif
+    return 0;
+}
+
+/* Queued IN Transfers */
+
+/*
+ * The transfer is cut into tx_size packets, a packet may take bytes from both spans.
+ * Packets are queued while the endpoint has buffer space, the rest is queued from CTR_TX.
+ * The spans must stay valid until the transfer is complete. All packets but the last
+ * one are full, so each CTR_TX adds up to tx_size bytes to the sent count.
+ */
+
+static void usb_transfer_send_packet(uint8_t ep_num, usb_transfer_t *transfer) {
+    size_t tx_size = usb_endpoints[ep_num].tx_size;
+    size_t span_size = transfer->span_size < tx_size ? transfer->span_size : tx_size;
+    size_t wrap_span_size = transfer->wrap_span_size < (tx_size - span_size) ? transfer->wrap_span_size : (tx_size - span_size);
+    size_t count = span_size + wrap_span_size;
+    const uint8_t *span = transfer->span;
+    const uint8_t *wrap_span = transfer->wrap_span;
+    volatile usb_btable_buffer_t *tx_buffer = usb_tx_buffer(ep_num);
+    transfer->span += span_size;
+    transfer->span_size -= span_size;
+    transfer->wrap_span += wrap_span_size;
+    transfer->wrap_span_size -= wrap_span_size;
+    if (transfer->span_size == 0) {
+        transfer->span = transfer->wrap_span;
+        transfer->span_size = transfer->wrap_span_size;
+        transfer->wrap_span_size = 0;
+    }
+    if ((transfer->span_size == 0) && ((count < tx_size) || !transfer->zlp)) {
+        transfer->last_queued = 1;
+    }
+    transfer->packets_in_flight++;
+#if USB_PMA_DMA
+    if (usb_pma_dma_submit(ep_num, 1, tx_buffer, (uint8_t*)span, span_size,
+                           (uint8_t*)wrap_span, wrap_span_size, 0, 0)) {
+        return;
+    }
+#endif
+    usb_pbuffer_write_spans(usb_pbuffer(tx_buffer), span, span_size, wrap_span, wrap_span_size);
+    usb_tx_commit(ep_num, tx_buffer, count);
+}
+
+static void usb_transfer_fill(uint8_t ep_num) {
+    usb_transfer_t *transfer = &usb_transfers[ep_num];
+    while (transfer->active && !transfer->last_queued && usb_space_available(ep_num)) {
+        usb_transfer_send_packet(ep_num, transfer);
+    }
+}
+
+/* Returns 1 if CTR_TX is to be reported to the endpoint event handler */
+static int usb_transfer_tx_complete(uint8_t ep_num) {
+    usb_transfer_t *transfer = &usb_transfers[ep_num];
+    if (transfer->active) {
+        if (transfer->packets_in_flight) {
+            size_t tx_size = usb_endpoints[ep_num].tx_size;
+            transfer->sent += ((transfer->size - transfer->sent) < tx_size) ? (transfer->size - transfer->sent) : tx_size;
+            transfer->packets_in_flight--;
+        }
+        if (transfer->last_queued) {
+            if (transfer->packets_in_flight == 0) {
+                transfer->active = 0;
+                return 1;
+            }
+        } else {
+            usb_transfer_fill(ep_num);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int usb_transfer_send_spans(uint8_t ep_num, const void *span, size_t span_size,
+                            const void *wrap_span, size_t wrap_span_size, int zlp) {
+    usb_transfer_t *transfer = &usb_transfers[ep_num];
+    if (transfer->active) {
+        return -1;
+    }
+    transfer->span = span;
+    transfer->span_size = span_size;
+    transfer->wrap_span = wrap_span;
+    transfer->wrap_span_size = wrap_span_size;
+    if (span_size == 0) {
+        transfer->span = wrap_span;
+        transfer->span_size = wrap_span_size;
+        transfer->wrap_span_size = 0;
+    }
+    transfer->size = span_size + wrap_span_size;
+    transfer->sent = 0;
+    transfer->zlp = zlp;
+    transfer->last_queued = 0;
+    transfer->packets_in_flight = 0;
+    usb_dbl_buf_lock();
+    transfer->active = 1;
+    usb_transfer_fill(ep_num);
+    usb_dbl_buf_unlock();
+    return 0;
+}
+
+int usb_transfer_send(uint8_t ep_num, const void *buf, size_t count, int zlp) {
+    return usb_transfer_send_spans(ep_num, buf, count, 0, 0, zlp);
+}
+
+int usb_transfer_busy(uint8_t ep_num) {
+    return usb_transfers[ep_num].active;
+}
+
+size_t usb_transfer_sent(uint8_t ep_num) {
+    return usb_transfers[ep_num].sent;
+}
+
+void usb_transfer_cancel(uint8_t ep_num) {
+    usb_transfers[ep_num].active = 0;
+}
+
+void usb_transfer_stop(uint8_t ep_num) {
+    usb_transfer_t *transfer = &usb_transfers[ep_num];
+    usb_dbl_buf_lock();
+    if (transfer->active) {
+        if (transfer->packets_in_flight) {
+            transfer->last_queued = 1;
+        } else {
+            transfer->active = 0;
+        }
+    }
+    usb_dbl_buf_unlock();
+}
+
 /* Endpoint Stall */
 
 void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_direction, uint8_t ep_stall) {
@@ -191,7 +697,13 @@ void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_directio
         if (ep_direction == usb_endpoint_direction_in) {
             if ((*ep_reg & USB_EPTX_STAT) != USB_EP_TX_DIS) {
                 if (ep_stall) {
+                    usb_transfer_cancel(ep_num);
                     *ep_reg = ((*ep_reg ^ USB_EP_TX_STALL) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                } else if (usb_endpoints[ep_num].buffering == usb_endpoint_buffer_dbl_tx) {
+                    usb_dbl_buf_lock();
+                    usb_dbl_buf_tx_pending &= ~(1 << ep_num);
+                    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT | USB_EP_DTOG_TX | USB_EP_TX_SW_BUF)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                    usb_dbl_buf_unlock();
                 } else {
                     *ep_reg = ((*ep_reg ^ USB_EP_TX_NAK) & (USB_EPREG_MASK | USB_EPTX_STAT | USB_EP_DTOG_TX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
                 }
@@ -215,52 +727,157 @@ int usb_endpoint_is_stalled(uint8_t ep_num, usb_endpoint_direction_t ep_directio
     return (*ep_regs(ep_num) & USB_EPRX_STAT) == USB_EP_RX_STALL;
 }
 
-/* USB Polling */
+/* USB Event Handling */
 
 static uint8_t usb_transfer_led_timer = 0;
 
 uint16_t istr;
 
-void usb_poll() {
-    istr = USB->ISTR;
-    if (istr & USB_ISTR_CTR) {
-        uint8_t ep_num = USB->ISTR & USB_ISTR_EP_ID;
-        ep_reg_t *ep_reg = ep_regs(ep_num);
-        if (*ep_reg & USB_EP_CTR_TX) {
-            *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_RX);
-            if (usb_endpoints[ep_num].event_handler) {
-                usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_sent);
+static void usb_handle_ctr(uint8_t ep_num) {
+    ep_reg_t *ep_reg = ep_regs(ep_num);
+    if (*ep_reg & USB_EP_CTR_TX) {
+        *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_RX);
+        usb_dbl_buf_tx_release(ep_num);
+        if (usb_transfer_tx_complete(ep_num) && usb_endpoints[ep_num].event_handler) {
+            usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_sent);
+        }
+    } else {
+        usb_endpoint_event_t ep_event = usb_endpoint_event_data_received;
+        if (*ep_reg & USB_EP_SETUP) {
+            ep_event = usb_endpoint_event_setup;
+        }
+        usb_trace_packet((ep_event == usb_endpoint_event_setup) ? trace_record_setup : trace_record_out, ep_num,
+                         usb_rx_buffer(ep_num), usb_bytes_available(ep_num));
+        *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_TX);
+        if (usb_endpoints[ep_num].event_handler) {
+            usb_endpoints[ep_num].event_handler(ep_num, ep_event);
+        }
+    }
+    usb_transfer_led_timer = USB_TRANSFER_LED_TIME;
+    status_led_set(1);
+}
+
+/* CTR of double-buffered endpoints is left to the high priority interrupt */
+static int usb_ctr_is_high_priority(uint8_t ep_num) {
+    return USB_IRQ_HP_CTR && (usb_endpoints[ep_num].buffering != usb_endpoint_buffer_single);
+}
+
+static usb_io_poll_stats_t usb_io_poll_stats;
+
+const usb_io_poll_stats_t *usb_io_get_poll_stats() {
+    return &usb_io_poll_stats;
+}
+
+/*
+ * Handles every pending event before returning: completed DMA reads, all CTR events
+ * in the order reported by the peripheral, then reset, suspend, wakeup and SOF.
+ * The number of events per pass is capped so the caller always gets control back.
+ */
+
+static void usb_handle_events() {
+    size_t events_count = 0;
+#if USB_PMA_DMA
+    uint8_t read_events = __sync_fetch_and_and(&usb_pma_dma_read_events, 0);
+    for (uint8_t ep_num = 0; read_events; ep_num++, read_events >>= 1) {
+        if ((read_events & 0x01) && usb_endpoints[ep_num].event_handler) {
+            usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_read);
+        }
+    }
+    uint8_t write_events = __sync_fetch_and_and(&usb_pma_dma_write_events, 0);
+    for (uint8_t ep_num = 0; write_events; ep_num++, write_events >>= 1) {
+        if (write_events & 0x01) {
+            usb_dbl_buf_lock();
+            usb_transfer_fill(ep_num);
+            usb_dbl_buf_unlock();
+        }
+    }
+#endif
+    while (events_count < USB_IO_MAX_EVENTS_PER_PASS) {
+        istr = USB->ISTR;
+        if ((istr & USB_ISTR_CTR) && !usb_ctr_is_high_priority(istr & USB_ISTR_EP_ID)) {
+            usb_handle_ctr(istr & USB_ISTR_EP_ID);
+            usb_io_poll_stats.ctr_events++;
+        } else if (istr & USB_ISTR_RESET) {
+            USB->ISTR = (uint16_t)(~USB_ISTR_RESET);
+            usb_device_handle_reset();   
+        } else if (istr & USB_ISTR_SUSP) {
+            USB->ISTR = (uint16_t)(~USB_ISTR_SUSP);
+            USB->CNTR |= USB_CNTR_FSUSP;
+            status_led_set(0);
+            usb_device_handle_suspend();
+        } else if (istr & USB_ISTR_WKUP) {
+            USB->ISTR = (uint16_t)(~USB_ISTR_WKUP);
+            USB->CNTR &= ~USB_CNTR_FSUSP;
+            usb_device_handle_wakeup();
+        } else if (istr & USB_ISTR_SOF) {
+            USB->ISTR = (uint16_t)(~USB_ISTR_SOF);
+            system_time_sof();
+            if (usb_transfer_led_timer) {
+                status_led_set(--usb_transfer_led_timer);
             }
+            usb_device_handle_frame();
         } else {
-            usb_endpoint_event_t ep_event = usb_endpoint_event_data_received;
-            if (*ep_reg & USB_EP_SETUP) {
-                ep_event = usb_endpoint_event_setup;
-            }
-            *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_TX);
-            if (usb_endpoints[ep_num].event_handler) {
-                usb_endpoints[ep_num].event_handler(ep_num, ep_event);
-            }
+            break;
         }
-        usb_transfer_led_timer = USB_TRANSFER_LED_TIME;
-        status_led_set(1);
-    } else if (istr & USB_ISTR_RESET) {
-        USB->ISTR = (uint16_t)(~USB_ISTR_RESET);
-        usb_device_handle_reset();   
-    } else if (istr & USB_ISTR_SUSP) {
-        USB->ISTR = (uint16_t)(~USB_ISTR_SUSP);
-        USB->CNTR |= USB_CNTR_FSUSP;
-        status_led_set(0);
-        usb_device_handle_suspend();
-    } else if (istr & USB_ISTR_WKUP) {
-        USB->ISTR = (uint16_t)(~USB_ISTR_WKUP);
-        USB->CNTR &= ~USB_CNTR_FSUSP;
-        usb_device_handle_wakeup();
-    } else if (istr & USB_ISTR_SOF) {
-        USB->ISTR = (uint16_t)(~USB_ISTR_SOF);
-        if (usb_transfer_led_timer) {
-            status_led_set(--usb_transfer_led_timer);
+        events_count++;
+    }
+    if (events_count) {
+        event_trace_write(event_trace_usb_poll, EVENT_TRACE_NO_PORT, events_count);
+    }
+    usb_io_poll_stats.passes++;
+    usb_io_poll_stats.events += events_count;
+    usb_io_poll_stats.pass_events[events_count < USB_IO_POLL_HISTOGRAM_SIZE ?
+                                  events_count : USB_IO_POLL_HISTOGRAM_SIZE - 1]++;
+    if (events_count > usb_io_poll_stats.max_pass_events) {
+        usb_io_poll_stats.max_pass_events = events_count;
+    }
+}
+
+/* USB Polling */
+
+#if USB_IRQ_DRIVEN
+
+void usb_poll() {
+    __WFI();
+}
+
+/* USB Interrupt Handlers */
+
+void USB_LP_CAN1_RX0_IRQHandler() {
+    (void)USB_LP_CAN1_RX0_IRQHandler;
+    uint32_t perf_start = perf_probe_begin();
+    usb_handle_events();
+    usb_poll_request();
+    perf_probe_end(perf_probe_usb_poll, perf_start);
+}
+
+#if USB_IRQ_HP_CTR
+void USB_HP_CAN1_TX_IRQHandler() {
+    (void)USB_HP_CAN1_TX_IRQHandler;
+    uint16_t hp_istr;
+    while ((hp_istr = USB->ISTR) & USB_ISTR_CTR) {
+        uint8_t ep_num = hp_istr & USB_ISTR_EP_ID;
+        if (!usb_ctr_is_high_priority(ep_num)) {
+            break;
         }
-        usb_device_handle_frame();
+        usb_handle_ctr(ep_num);
     }
+    usb_poll_request();
+}
+#endif
+
+void PendSV_Handler() {
+    (void)PendSV_Handler;
     usb_device_poll();
 }
+
+#else
+
+void usb_poll() {
+    uint32_t perf_start = perf_probe_begin();
+    usb_handle_events();
+    usb_device_poll();
+    perf_probe_end(perf_probe_usb_poll, perf_start);
+}
+
+#endif
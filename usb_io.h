@@ -12,16 +12,51 @@
 #include <stddef.h>
 #include <stm32f1xx.h>
 #include "circ_buf.h"
+#include "usb_pbuffer.h"
 #include "usb.h"
 #include "usb_std.h"
 #include "usb_core.h"
 
 #define USB_TRANSFER_LED_TIME       20 /* usb frames, 1 ms each at full speed */
 
-#define USB_PACKET_BUFFER_ALIGNMENT 4
+/*
+ * Interrupt-Driven Mode
+ *
+ * USB events are handled in the USB low priority interrupt instead of usb_poll().
+ * Class housekeeping (usb_device_poll) runs in PendSV at the lowest priority,
+ * it is requested by every USB interrupt and by usb_poll_request().
+ * usb_poll() just puts the core to sleep until the next interrupt.
+ *
+ * With USB_IRQ_HP_CTR, CTR of double-buffered endpoints is handled
+ * in the USB high priority interrupt, data_sent events of these endpoints
+ * are delivered from that context.
+ */
+
+#ifndef USB_IRQ_DRIVEN
+#define USB_IRQ_DRIVEN              0
+#endif
+
+#ifndef USB_IRQ_HP_CTR
+#define USB_IRQ_HP_CTR              0
+#endif
+
+/*
+ * Packet Memory DMA
+ *
+ * With USB_PMA_DMA, usb_circ_buf_read_async and queued IN transfers copy
+ * packet payloads with DMA1 Channel 1. The endpoint is armed/released from
+ * the DMA completion interrupt, a completed read is then reported from the USB event
+ * context with usb_endpoint_event_data_read. Packets that cannot use DMA
+ * are copied by the CPU right away.
+ */
+
+#ifndef USB_PMA_DMA
+#define USB_PMA_DMA                 0
+#endif
 
-typedef uint16_t    pb_word_t;
-typedef pb_word_t   pb_aligned_word_t __attribute__ ((aligned(USB_PACKET_BUFFER_ALIGNMENT)));
+#if USB_IRQ_HP_CTR && !USB_IRQ_DRIVEN
+#error "USB_IRQ_HP_CTR requires USB_IRQ_DRIVEN"
+#endif
 
 typedef struct {
     pb_aligned_word_t tx_offset;
@@ -30,11 +65,15 @@ typedef struct {
     pb_aligned_word_t rx_count;
 } usb_btable_entity_t;
 
+/* Double-buffered endpoints use both halves of the entity for one direction */
 typedef struct {
-    pb_aligned_word_t data;
-} usb_pbuffer_data_t;
+    pb_aligned_word_t offset;
+    pb_aligned_word_t count;
+} usb_btable_buffer_t;
 
-#define USB_BTABLE_SIZE (sizeof(usb_btable_entity_t) * USB_NUM_ENDPOINTS)
+/* Packet memory is 16-bit wide, the CPU sees it with a 32-bit stride */
+#define USB_PMA_SIZE    0x200
+#define USB_BTABLE_SIZE ((sizeof(usb_btable_entity_t) >> 1) * USB_NUM_ENDPOINTS)
 #define USB_BTABLE_SMALL_BLOCK_SIZE (sizeof(uint16_t))
 #define USB_BTABLE_LARGE_BLOCK_SIZE (USB_BTABLE_SMALL_BLOCK_SIZE<<4)
 #define USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT ((USB_COUNT0_RX_NUM_BLOCK>>USB_COUNT0_RX_NUM_BLOCK_Pos)<<1)
@@ -44,14 +83,28 @@ typedef struct {
 typedef volatile uint16_t ep_reg_t;
 #define ep_regs(ep_num) (((ep_reg_t*)USB_BASE) + (ep_num << 1))
 
+/* In double-buffered mode, DTOG of the unused direction is the application buffer pointer */
+
+#define USB_EP_TX_SW_BUF    USB_EP_DTOG_RX
+#define USB_EP_RX_SW_BUF    USB_EP_DTOG_TX
+
 /* USB Endpoint I/O Events */
 
 typedef enum {
     usb_endpoint_event_data_received    = 0x01,
     usb_endpoint_event_data_sent        = 0x02,
     usb_endpoint_event_setup            = 0x03,
+    usb_endpoint_event_data_read        = 0x04, /* asynchronous read complete */
 } usb_endpoint_event_t;
 
+/* USB Endpoint Buffering */
+
+typedef enum {
+    usb_endpoint_buffer_single  = 0x00,
+    usb_endpoint_buffer_dbl_tx  = 0x01, /* bulk IN only, uses tx_size */
+    usb_endpoint_buffer_dbl_rx  = 0x02, /* bulk OUT only, uses rx_size */
+} usb_endpoint_buffer_t;
+
 /* USB Endpoint Definition */
 
 typedef void (*usb_endpoint_event_handler_t)(uint8_t ep_num, usb_endpoint_event_t ep_event);
@@ -60,6 +113,7 @@ typedef struct {
     uint32_t    type;
     uint8_t     rx_size;
     uint8_t     tx_size;
+    uint8_t     buffering;
     usb_endpoint_event_handler_t event_handler;
 } usb_endpoint_t;
 
@@ -71,6 +125,33 @@ typedef struct {
 void usb_io_init();
 void usb_io_reset();
 
+/* Deferred Context */
+
+/*
+ * usb_io_lock/usb_io_unlock keep USB event handlers out of the deferred context,
+ * they must not be nested. With USB_IRQ_HP_CTR the high priority interrupt is
+ * held off as well. Both are no-ops in polling mode.
+ */
+
+void usb_io_lock();
+void usb_io_unlock();
+void usb_poll_request();
+
+/* Event Dispatch Statistics */
+
+#define USB_IO_MAX_EVENTS_PER_PASS  32
+#define USB_IO_POLL_HISTOGRAM_SIZE  8 /* the last bucket counts passes with 7 or more events */
+
+typedef struct {
+    uint32_t passes;
+    uint32_t events;
+    uint32_t ctr_events;
+    uint32_t max_pass_events;
+    uint32_t pass_events[USB_IO_POLL_HISTOGRAM_SIZE];
+} usb_io_poll_stats_t;
+
+const usb_io_poll_stats_t *usb_io_get_poll_stats();
+
 /* Get Number of RX/TX Bytes Available  */
 
 size_t usb_bytes_available(uint8_t ep_num);
@@ -88,6 +169,35 @@ size_t usb_circ_buf_read(uint8_t ep_num, circ_buf_t *buf, size_t buf_size);
 /* NOTE: usb_circ_buf_send assumes endpoint is ready to send */
 size_t usb_circ_buf_send(uint8_t ep_num, circ_buf_t *buf, size_t buf_size);
 
+/* Asynchronous variant, the buffer head is updated when the copy is complete */
+size_t usb_circ_buf_read_async(uint8_t ep_num, circ_buf_t *buf, size_t buf_size);
+/* Bytes of an asynchronous read not yet added to the buffer head */
+size_t usb_circ_buf_read_pending(circ_buf_t *buf);
+
+/* Queued IN Transfers */
+
+/*
+ * Sends a buffer or two ring spans of any length as a sequence of packets.
+ * With zlp set, a transfer that ends with a full packet is terminated by a ZLP.
+ * usb_endpoint_event_data_sent is reported once, when the whole transfer is sent.
+ * Returns -1 if a transfer is already in progress on the endpoint.
+ *
+ * usb_transfer_sent returns the bytes of the last transfer acknowledged by the host
+ * so far, it grows a packet at a time. The sender may release that part of the spans
+ * before the transfer is complete.
+ *
+ * usb_transfer_stop stops reading the spans, the transfer is complete once the packets
+ * already queued are sent. usb_transfer_cancel drops the transfer state at once.
+ */
+
+int usb_transfer_send(uint8_t ep_num, const void *buf, size_t count, int zlp);
+int usb_transfer_send_spans(uint8_t ep_num, const void *span, size_t span_size,
+                            const void *wrap_span, size_t wrap_span_size, int zlp);
+int usb_transfer_busy(uint8_t ep_num);
+size_t usb_transfer_sent(uint8_t ep_num);
+void usb_transfer_cancel(uint8_t ep_num);
+void usb_transfer_stop(uint8_t ep_num);
+
 /* Endpoint Stall */
 
 void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_direction, uint8_t ep_stall);
@@ -0,0 +1,146 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef USB_PBUFFER_H
+#define USB_PBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packet Buffer Words */
+
+#define USB_PACKET_BUFFER_ALIGNMENT 4
+
+typedef uint16_t    pb_word_t;
+typedef pb_word_t   pb_aligned_word_t __attribute__ ((aligned(USB_PACKET_BUFFER_ALIGNMENT)));
+
+typedef struct {
+    pb_aligned_word_t data;
+} usb_pbuffer_data_t;
+
+/* Packet Memory Copy Kernels */
+
+/*
+ * Each 16-bit packet memory word is followed by a 16-bit gap in the CPU address space,
+ * so the copy loops move one word per iteration, unrolled by 4. Even source/destination
+ * addresses use halfword accesses, odd ones are assembled from bytes.
+ */
+
+inline static usb_pbuffer_data_t *usb_pbuffer_write_words(usb_pbuffer_data_t *ep_buf, const uint8_t *src, size_t words_count) {
+    if (((uintptr_t)src & 0x01) == 0) {
+        const pb_word_t *src_p = (const pb_word_t *)src;
+        while (words_count >= 4) {
+            ep_buf[0].data = src_p[0];
+            ep_buf[1].data = src_p[1];
+            ep_buf[2].data = src_p[2];
+            ep_buf[3].data = src_p[3];
+            ep_buf += 4;
+            src_p += 4;
+            words_count -= 4;
+        }
+        while (words_count--) {
+            (ep_buf++)->data = *src_p++;
+        }
+    } else {
+        while (words_count >= 4) {
+            ep_buf[0].data = src[0] | (src[1] << 8);
+            ep_buf[1].data = src[2] | (src[3] << 8);
+            ep_buf[2].data = src[4] | (src[5] << 8);
+            ep_buf[3].data = src[6] | (src[7] << 8);
+            ep_buf += 4;
+            src += 8;
+            words_count -= 4;
+        }
+        while (words_count--) {
+            (ep_buf++)->data = src[0] | (src[1] << 8);
+            src += 2;
+        }
+    }
+    return ep_buf;
+}
+
+inline static usb_pbuffer_data_t *usb_pbuffer_read_words(usb_pbuffer_data_t *ep_buf, uint8_t *dst, size_t words_count) {
+    if (((uintptr_t)dst & 0x01) == 0) {
+        pb_word_t *dst_p = (pb_word_t *)dst;
+        while (words_count >= 4) {
+            dst_p[0] = ep_buf[0].data;
+            dst_p[1] = ep_buf[1].data;
+            dst_p[2] = ep_buf[2].data;
+            dst_p[3] = ep_buf[3].data;
+            ep_buf += 4;
+            dst_p += 4;
+            words_count -= 4;
+        }
+        while (words_count--) {
+            *dst_p++ = (ep_buf++)->data;
+        }
+    } else {
+        while (words_count >= 4) {
+            pb_word_t w0 = ep_buf[0].data;
+            pb_word_t w1 = ep_buf[1].data;
+            pb_word_t w2 = ep_buf[2].data;
+            pb_word_t w3 = ep_buf[3].data;
+            dst[0] = (uint8_t)w0; dst[1] = (uint8_t)(w0 >> 8);
+            dst[2] = (uint8_t)w1; dst[3] = (uint8_t)(w1 >> 8);
+            dst[4] = (uint8_t)w2; dst[5] = (uint8_t)(w2 >> 8);
+            dst[6] = (uint8_t)w3; dst[7] = (uint8_t)(w3 >> 8);
+            ep_buf += 4;
+            dst += 8;
+            words_count -= 4;
+        }
+        while (words_count--) {
+            pb_word_t w = (ep_buf++)->data;
+            dst[0] = (uint8_t)w;
+            dst[1] = (uint8_t)(w >> 8);
+            dst += 2;
+        }
+    }
+    return ep_buf;
+}
+
+/*
+ * Copies up to two contiguous spans. If the first span has an odd length,
+ * the packet memory word on the span boundary takes one byte from each span.
+ */
+
+inline static void usb_pbuffer_copy_from_spans(usb_pbuffer_data_t *ep_buf, const uint8_t *span, size_t span_size,
+                                               const uint8_t *wrap_span, size_t wrap_span_size) {
+    ep_buf = usb_pbuffer_write_words(ep_buf, span, span_size >> 1);
+    if (span_size & 0x01) {
+        span += span_size - 1;
+        if (wrap_span_size) {
+            (ep_buf++)->data = span[0] | (wrap_span[0] << 8);
+            wrap_span++;
+            wrap_span_size--;
+        } else {
+            ep_buf->data = span[0];
+        }
+    }
+    ep_buf = usb_pbuffer_write_words(ep_buf, wrap_span, wrap_span_size >> 1);
+    if (wrap_span_size & 0x01) {
+        ep_buf->data = wrap_span[wrap_span_size - 1];
+    }
+}
+
+inline static void usb_pbuffer_copy_to_spans(usb_pbuffer_data_t *ep_buf, uint8_t *span, size_t span_size,
+                                             uint8_t *wrap_span, size_t wrap_span_size) {
+    ep_buf = usb_pbuffer_read_words(ep_buf, span, span_size >> 1);
+    if (span_size & 0x01) {
+        pb_word_t pb_word = (ep_buf++)->data;
+        span[span_size - 1] = (uint8_t)pb_word;
+        if (wrap_span_size) {
+            wrap_span[0] = (uint8_t)(pb_word >> 8);
+            wrap_span++;
+            wrap_span_size--;
+        }
+    }
+    ep_buf = usb_pbuffer_read_words(ep_buf, wrap_span, wrap_span_size >> 1);
+    if (wrap_span_size & 0x01) {
+        wrap_span[wrap_span_size - 1] = (uint8_t)ep_buf->data;
+    }
+}
+
+#endif /* USB_PBUFFER_H */